@@ -12,8 +12,35 @@ extern "C" {
 
 typedef void (*CAN_RxCallback)(uint32_t id, bool rtr, uint8_t *data, uint8_t dataLen);
 
+// Transmit priority, lowest number goes out first. Each has its own queue and deadline (pl455_config.h).
+enum CAN_Priority
+{
+    CAN_PRIO_PROTECTION, // fault reports
+    CAN_PRIO_CONTROL,    // replies to the inverter
+    CAN_PRIO_TELEMETRY,  // periodic data, stale soon
+    CAN_PRIO_COUNT
+};
+
+struct CAN_TxStats
+{
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t retries;
+    uint32_t failed;                   // out of retries or past the deadline when the controller gave up
+    uint32_t expired;                  // past the deadline before a mailbox came free
+    uint32_t dropped[CAN_PRIO_COUNT];  // oldest frame pushed out of a full queue
+};
+
 int CAN_Initialize(CAN_RxCallback rxCallback);
-int CAN_Send(uint32_t id, uint8_t *data, uint8_t dataLen);
+
+// Both only queue the frame and return - a thread feeds the controller. CAN_ERROR only for a bad frame.
+int CAN_Send(uint32_t id, uint8_t *data, uint8_t dataLen); // telemetry priority
+int CAN_SendPriority(uint32_t id, uint8_t *data, uint8_t dataLen, enum CAN_Priority priority);
+// CAN FD with bitrate switch, up to 64 bytes. CAN_ERROR unless CAN_FdActive().
+int CAN_SendFd(uint32_t id, uint8_t *data, uint8_t dataLen, enum CAN_Priority priority);
+// the controller runs in CAN FD mode (CAN_FD_TELEMETRY, CONFIG_CAN_FD_MODE and a controller that has it)
+bool CAN_FdActive(void);
+void CAN_GetTxStats(struct CAN_TxStats *stats);
 
 #ifdef __cplusplus
 }
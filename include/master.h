@@ -4,6 +4,7 @@
 #include "module_data.h"
 #include <cstddef>
 #include "gpio.h"
+#include <zephyr/sys/atomic.h>
 
 #ifndef CONFIG_MASTER_BMS_LOG_LEVEL
 #define CONFIG_MASTER_BMS_LOG_LEVEL LOG_LEVEL_INF
@@ -21,6 +22,10 @@ public:
     // Returns true if successful, false on invalid index
     bool updateModuleData(uint8_t moduleIndex, const ModuleData& data);
 
+    // Latches the hardware comparator state of a module (ProtectionFlag bits, 0 when cleared).
+    // Safe to call from any thread, forbids charge/discharge immediately.
+    void setProtection(uint8_t moduleIndex, uint8_t flags);
+
     // Process all received module data to update master status
     void processData();
 
@@ -52,6 +57,9 @@ private:
     int64_t lastUpdateTimeMs_[NUM_MODULES] = {0}; // Track data freshness
     bool allModulesInitialized_ = false;
     bool communicationOk_ = false; // Tracks if all modules are communicating within timeout
+    atomic_t protectionFlags_[NUM_MODULES] = {}; // Hardware comparator state per module, set by setProtection()
+    int16_t maxTemp_01C_ = 250; // Hottest and coldest sensor of the last processData(), for derating
+    int16_t minTemp_01C_ = 250;
 
     // Output data storage
     Message::Status outputStatus_{};
@@ -77,15 +85,15 @@ private:
     static constexpr uint16_t MODULE_OVER_VOLTAGE_ALARM_THRESHOLD_01V = (360 * 32) / 10;     // 3.60V/cell * 32 cells -> 115.2V -> 1152 * 0.1V
     static constexpr uint16_t MODULE_UNDER_VOLTAGE_ALARM_THRESHOLD_01V = (270 * 32) / 10;    // 2.70V/cell * 32 cells -> 86.4V -> 864 * 0.1V
 
-    // Temperatures in 0.1C (Non-negative)
-    static constexpr uint16_t CHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C = 500;   // 50.0 C
-    static constexpr uint16_t CHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C = 0;      // 0.0 C
-    static constexpr uint16_t DISCHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C = 600;  // 60.0 C
-    static constexpr uint16_t DISCHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C = 10; // 1.0 C (Example, avoid discharge below freezing if needed, was -200 before)
-    static constexpr uint16_t CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C = 450;    // 45.0 C
-    static constexpr uint16_t CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C = 50;     // 5.0 C
-    static constexpr uint16_t DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C = 550;   // 55.0 C
-    static constexpr uint16_t DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C = 50;    // 5.0 C (Was -100 before)
+    // Temperatures in 0.1C (signed)
+    static constexpr int16_t CHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C = 500;   // 50.0 C
+    static constexpr int16_t CHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C = 0;      // 0.0 C
+    static constexpr int16_t DISCHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C = 600;  // 60.0 C
+    static constexpr int16_t DISCHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C = 10; // 1.0 C (Example, avoid discharge below freezing if needed, was -200 before)
+    static constexpr int16_t CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C = 450;    // 45.0 C
+    static constexpr int16_t CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C = 50;     // 5.0 C
+    static constexpr int16_t DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C = 550;   // 55.0 C
+    static constexpr int16_t DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C = 50;    // 5.0 C (Was -100 before)
 
     // Currents in 0.1A (System Level)
     // Note: Input current is 0.1mA, requires scaling
@@ -121,8 +129,8 @@ private:
 
     // System Voltage Limits in 0.1V (Example values)
     // Calculated based on NUM_MODULES, defined in constructor or method
-    uint16_t SYSTEM_CHARGE_CUTOFF_VOLTAGE_01V = (360 * 32 * NUM_MODULES) / 10; // ~3.6V per cell
-    uint16_t SYSTEM_DISCHARGE_CUTOFF_VOLTAGE_01V = (280 * 32 * NUM_MODULES) / 10; // ~2.8V per cell
+    uint16_t SYSTEM_CHARGE_CUTOFF_VOLTAGE_01V = (360 * ModuleData::cells * NUM_MODULES) / 10; // ~3.6V per cell
+    uint16_t SYSTEM_DISCHARGE_CUTOFF_VOLTAGE_01V = (280 * ModuleData::cells * NUM_MODULES) / 10; // ~2.8V per cell
 
 
     // --- Private Helper Methods ---
@@ -1,12 +1,29 @@
 #pragma once
 
 #include <stdint.h>
+#include "pl455_config.h"
 
 constexpr uint32_t BaseAddress = 	0x11DD0000;
 constexpr uint32_t ModuleOffset = 		0x1000;
-constexpr uint32_t ModuleStateOffset = 	 0x000;
+constexpr uint32_t ModuleStateOffset = 	 0x000; // channel 0 starts a round, channel 1 ends a delta round (TELEMETRY_DELTA)
 constexpr uint32_t CellStateOffset = 	 0x100;
 constexpr uint32_t AdcVoltageOffset =    0x200;
+constexpr uint32_t ProtectionOffset =    0x300;
+constexpr uint32_t CurrentOffset =       0x400; // channel 0 CurrentState, channel 1 ChargeState
+constexpr uint32_t TemperatureOffset =   0x500; // channel device*8 + aux, int16_t in 0,1C steps
+constexpr uint32_t LinkStatsOffset =     0x600; // channel device: LinkDeviceStats, LinkChainChannel + chain: LinkChainStats, LinkRateChannel: AcquisitionRate
+constexpr uint32_t LinkChainChannel =     0x80;
+constexpr uint32_t LinkRateChannel =      0x90;
+constexpr uint32_t CaptureOffset =       0x700; // channel 0 CaptureCommand, 1 CaptureRead (host to module), 2 CaptureStatus, 3 CaptureData
+// packed telemetry (TELEMETRY_PACKED): the data types with PackedFlag set, the ones below it are the legacy layout
+constexpr uint32_t PackedFlag =          0x800;
+constexpr uint32_t PackedCellOffset =    0x800; // channel n: PackedValues of cells 4n to 4n + 3, in 0,1mV steps
+constexpr uint32_t BalanceOffset =       0x900; // channel n: BalanceBitmap of cells 32n to 32n + 31
+constexpr uint32_t PackedAdcOffset =     0xA00; // channel n: PackedValues of aux inputs 4n to 4n + 3, raw ADC
+constexpr uint32_t PackedTemperatureOffset = 0xB00; // channel n: PackedValues of aux inputs 4n to 4n + 3, 0,1C steps, TemperatureNotFitted without a thermistor
+constexpr uint32_t FdSnapshotOffset =    0xC00; // CAN FD only (CAN_FD_TELEMETRY): channel n is bytes 64n to 64n + 63 of a ModuleDataT::FdSnapshot
+constexpr uint8_t FdSegmentBytes = 64;
+constexpr uint32_t CycleMarkerOffset =   0xD00; // module 0, channel 0: CycleMarker, starts a telemetry cycle (TELEMETRY_TDMA)
 constexpr uint32_t DataTypeMask =   	 0xF00;
 constexpr uint32_t DataChannelMask =   	  0xFF;
 constexpr uint32_t IdMask =   		 	0xF000;
@@ -19,21 +36,203 @@ struct CellState
 
 struct ModuleState
 {
-	// m1 + m2 gives module voltage, m1 is for first 16 cells m2 is for second 16 cells
+	// m1 + m2 gives module voltage, m1 is for the first half of the devices (cells) m2 for the second half
 	uint16_t m1Voltage; //in 0,1V steps
 	uint16_t m2Voltage; //in 0,1V steps
-	int16_t current; //in 0,1mA steps
-	uint16_t temperature; //in 0,1C steps
+	int16_t current; //in 10mA steps, like CurrentState - 0,1mA would only reach 3,2A
+	int16_t temperature; //in 0,1C steps, hottest sensor of the module
 } __attribute__((packed));
 
-struct ModuleData
+enum ProtectionFlag : uint8_t
 {
+	ProtectionUnderVoltage = 0x01, // a hardware comparator saw a cell below PL455_CMP_UV_MV
+	ProtectionOverVoltage = 0x02,  // a hardware comparator saw a cell above PL455_CMP_OV_MV
+};
+
+// sent by a module the moment its FAULT line changes, outside of the regular telemetry
+struct ProtectionState
+{
+	uint8_t flags; // ProtectionFlag bits, 0 once all comparators have cleared
+} __attribute__((packed));
+
+// fast current samples since the last publish, in 10mA steps
+struct CurrentState
+{
+	int16_t minimum;
+	int16_t maximum;
+	int16_t mean;
+	uint16_t rms;
+} __attribute__((packed));
+
+struct ChargeState
+{
+	int32_t charge; // integral of the current since start up, in mAs
+	uint32_t samples; // fast current samples since start up
+} __attribute__((packed));
+
+struct PackedValues
+{
+	uint16_t values[4];
+} __attribute__((packed));
+
+constexpr int16_t TemperatureNotFitted = INT16_MIN;
+
+struct BalanceBitmap
+{
+	uint32_t cells; // bit n = cell 32 * channel + n is balancing
+} __attribute__((packed));
+
+// module n publishes in slot n % slots, which starts n % slots * cycleMs / slots after the marker
+struct CycleMarker
+{
+	uint16_t cycleMs;
+	uint8_t slots;
+	uint8_t sequence;
+} __attribute__((packed));
+
+// PL455 link health, counters since start up (saturating)
+struct LinkDeviceStats
+{
+	uint16_t timeouts; // responses the device never gave
+	uint16_t crcErrors; // of those, the ones that arrived with a bad CRC
+} __attribute__((packed));
+
+struct LinkChainStats
+{
+	uint16_t noiseBytes; // bytes received outside of a response frame
+	uint16_t retries;
+	uint8_t breaks;
+	uint8_t resets;
+	uint8_t reinits;
+	uint8_t rxOverflows;
+} __attribute__((packed));
+
+// acquisition rate the chains run at right now (adaptive, see PL455Pack)
+struct AcquisitionRate
+{
+	uint32_t cyclePeriodUs;
+	uint16_t publishPeriodMs;
+} __attribute__((packed));
+
+enum CaptureTrigger : uint8_t
+{
+	CaptureTriggerNow = 0,
+	CaptureTriggerCurrentStep = 1, // armed until the fast current samples jump by PL455_CAPTURE_CURRENT_STEP
+	CaptureTriggerCancel = 2,
+};
+
+// burst capture of a few channels of one device, answered with a CaptureStatus
+struct CaptureCommand
+{
+	uint8_t chain;
+	uint8_t device;
+	uint16_t cellMask; // bit n = cell n + 1
+	uint8_t auxMask;
+	uint8_t trigger; // CaptureTrigger
+	uint16_t durationMs;
+} __attribute__((packed));
+
+// asks for words [offset, offset + count) of a finished capture, streamed as CaptureData
+struct CaptureRead
+{
+	uint16_t offset;
+	uint16_t count;
+} __attribute__((packed));
+
+struct CaptureStatus
+{
+	uint8_t state; // PL455CaptureState: 0 idle, 1 armed, 2 running, 3 done
+	uint8_t recordWords; // timestamp in us (2 words, low first) followed by the readings, cells first
+	uint16_t records;
+	uint32_t durationUs;
+} __attribute__((packed));
+
+struct CaptureData
+{
+	uint16_t offset; // of words[0] in the capture buffer
+	uint16_t words[3];
+} __attribute__((packed));
+
+// one bit per CAN channel of a data type
+template <uint16_t Bits>
+struct ChannelFlags
+{
+	uint32_t words[(Bits + 31) / 32] = {};
+
+	void set(uint16_t bit) { words[bit / 32] |= 1u << (bit % 32); }
+	bool test(uint16_t bit) const { return (words[bit / 32] >> (bit % 32)) & 1; }
+	void clear()
+	{
+		for (uint32_t &word : words)
+		{
+			word = 0;
+		}
+	}
+	bool none() const
+	{
+		for (uint32_t word : words)
+		{
+			if (word)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	bool all() const
+	{
+		for (uint16_t i = 0; i < Bits / 32; i++)
+		{
+			if (words[i] != 0xFFFFFFFF)
+			{
+				return false;
+			}
+		}
+		return (Bits % 32 == 0) || (words[Bits / 32] == ((1u << (Bits % 32)) - 1));
+	}
+};
+
+// Everything one CAN node reports, for a node with Devices PL455s over all of its chains.
+// Cells and aux inputs are numbered device by device, 16 and 8 per device.
+template <uint8_t Devices>
+struct ModuleDataT
+{
+	static_assert(Devices >= 1 && Devices <= 16, "a node reports 1 to 16 devices, the CAN channel field is 8 bits");
+	static constexpr uint8_t devices = Devices;
+	static constexpr uint16_t cells = Devices * NUM_CELLS;
+	static constexpr uint16_t auxes = Devices * 8;
+
     ModuleState moduleState;
-    CellState cellStates[32];
-	uint16_t adcStates[16];
-	void SetRawData(uint32_t address, uint8_t *data);
-	uint32_t cellStatesUpdateFlags = 0;
-	uint16_t adcUpdateFlags = 0;
+    CellState cellStates[cells];
+	uint16_t adcStates[auxes];
+	CurrentState currentState = {}; // not part of isComplete(), modules without the fast current path don't send it
+	ChargeState chargeState = {};
+	int16_t temperatures[auxes] = {}; // thermistors, in 0,1C steps - only the channels in temperatureUpdateFlags are fitted
+	void SetRawData(uint32_t address, uint8_t *data, uint8_t dataLen);
+	ChannelFlags<cells> cellStatesUpdateFlags;
+	ChannelFlags<auxes> adcUpdateFlags;
+	ChannelFlags<auxes> temperatureUpdateFlags;
 	bool moduleStateFlag = false;
+	bool deltaMode = false; // the module only sends what changed - values stay valid between rounds
+	uint32_t cellUpdatedMs[cells] = {}; // k_uptime_get_32() the cell's value last arrived
 	bool isComplete();
-};
\ No newline at end of file
+	uint16_t staleCells(uint32_t maxAgeMs) const; // cells without a value for longer than maxAgeMs
+
+	// a whole publish round but the temperatures and current in one piece, sent as a few CAN FD frames
+	struct FdSnapshot
+	{
+		ModuleState moduleState;
+		uint32_t balancing[(cells + 31) / 32]; // bit n of word w = cell 32w + n
+		uint16_t cellVoltages[cells];
+		uint16_t adcStates[auxes];
+	} __attribute__((packed));
+	static constexpr uint8_t fdSegments = (sizeof(FdSnapshot) + FdSegmentBytes - 1) / FdSegmentBytes;
+	void fillFdSnapshot(FdSnapshot &snapshot) const;
+
+private:
+	void applyFdSnapshot();
+	FdSnapshot fdStaging;
+	uint32_t fdSegmentsReceived = 0; // bit per segment of fdStaging filled in
+};
+
+using ModuleData = ModuleDataT<MODULE_DEVICES>;
\ No newline at end of file
@@ -1,86 +1,378 @@
 #include <zephyr/drivers/uart.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
 #include <errno.h>
 #include <string.h>
 #include "pl455_config.h"
+#include "pl455_uart.h"
+#include "pl455_link.h"
 #include "elapsedmillis.h"
 #include "module_data.h"
 #include "thread_wrapper.h"
 #include "gpio.h"
 
-#define SCOPE_SINGLE 0
-#define SCOPE_GROUP 1
-#define SCOPE_BRDCST 3
-
 #ifndef CONFIG_PL455_LOG_LEVEL
 #define CONFIG_PL455_LOG_LEVEL LOG_LEVEL_INF
 #endif
 
+struct PL455TimingStats
+{
+    uint32_t steps;
+    uint32_t overruns;       // steps that started after the following one was already due
+    int64_t minLatenessUs;   // how late a step started against its deadline
+    int64_t maxLatenessUs;
+    int64_t totalLatenessUs; // divide by steps for the mean
+    uint32_t initMs;         // the last init() or re-init, wakeup to the chain configured
+    uint32_t acquisitions;   // measurements, from the sample command to the last response processed
+    uint32_t lastAcquisitionUs;
+    uint32_t maxAcquisitionUs;
+    uint64_t totalAcquisitionUs; // divide by acquisitions for the mean
+};
+
+// Called on the chain's work queue whenever its FAULT line changes, with the ProtectionFlag
+// bits of every comparator that is currently tripped (0 once they have all cleared).
+typedef void (*PL455FaultCallback)(void *context, uint8_t chain, uint8_t flags);
+
+// Fast current samples, see PL455_CURRENT_SAMPLE_PERIOD_US. Currents in 0.1mA like ModuleState.
+struct PL455CurrentStats
+{
+    uint32_t samples;     // in the window
+    int32_t minimum;
+    int32_t maximum;
+    int32_t mean;
+    uint32_t rms;
+    int64_t chargeMAs;    // running integral since start up
+    uint32_t totalSamples;
+};
+
+// Link health of one chain
+struct PL455Health
+{
+    PL455UartStats uart;
+    PL455LinkStats link;
+    uint32_t reinits;       // full re-initialisations, the last step of the recovery ladder
+    uint8_t recoveryLevel;  // consecutive failed measurements, 0 when healthy
+    uint32_t staleReads;        // auto-monitor results that were the same conversion as the last read
+    uint32_t autoMonitorRearms; // times stale results made the chain set auto-monitor up again
+};
+
+// Burst capture: one device converts just the selected channels back to back, as fast as the
+// link allows, into a RAM buffer. Normal measurements on the chain pause meanwhile.
+struct PL455CaptureRequest
+{
+    uint8_t device;
+    uint16_t cellMask;   // bit n = cell n + 1
+    uint8_t auxMask;     // bit n = aux n
+    uint16_t durationMs;
+};
+
+enum class PL455CaptureState : uint8_t
+{
+    Idle,
+    Armed,   // waiting for a step in the fast current samples
+    Running,
+    Done,    // buffer holds a complete capture until the next one starts
+};
+
+// Capture buffer layout: one record per conversion, recordWords 16bit words each - the time since the
+// capture started in us (32bit, low word first), then the readings (raw ADC) in channel order, cells first.
+struct PL455CaptureInfo
+{
+    PL455CaptureState state;
+    uint8_t device;
+    uint16_t cellMask;
+    uint8_t auxMask;
+    uint8_t recordWords;
+    uint16_t records;
+    uint32_t durationUs;
+};
+
+// How busy a chain looks, from the last measurement
+enum class PL455Activity : uint8_t
+{
+    Rest,   // BMS_CYCLE_PERIOD_MAX
+    Normal, // BMS_CYCLE_PERIOD
+    Fast,   // BMS_CYCLE_PERIOD_MIN
+};
+
+// REG07 conversion profiles, more oversampling is quieter but takes longer per channel
+enum class PL455Oversampling : uint8_t
+{
+    Fast,     // 2x
+    Normal,   // 8x, recommended by TI
+    LowNoise, // 16x
+};
+
+// Called on the chain's work queue after every processed measurement
+typedef void (*PL455ActivityCallback)(void *context, uint8_t chain, PL455Activity activity);
+
+// Readings and balancing state of one device on a chain
+struct PL455Device
+{
+    uint16_t moduleVoltage;                 // raw ADC 16bit value
+    uint16_t cellVoltages[NUM_CELLS];       // latest readings, corrected for balancing
+    uint16_t cellFast[NUM_CELLS];           // filtered for protection and telemetry
+    uint32_t cellSlow[NUM_CELLS];           // filtered for balancing, 8 fractional bits
+    uint16_t cellHistory[NUM_CELLS][2];     // the two readings before the latest, for the median
+    uint16_t auxVoltages[8];
+    uint16_t balanceMask;                   // bit n set = cell n should balance
+    uint16_t balanceShadow;                 // what register 0x14 currently holds
+    uint16_t sampleMask;                    // balance switches that were on during the conversion
+    uint16_t calibrationMask;               // the same for the calibration sample
+    uint16_t calibrationReadings[NUM_CELLS];
+    int16_t balanceDrop[NUM_CELLS];         // ADC counts a cell reads low while its own switch is on
+    uint16_t balanceDropValid;              // cells with a learned drop
+    uint16_t resultCrc;                     // CRC of the last auto-monitor results, the same again means stale
+    uint8_t staleReads;                     // stale results in a row
+};
+
+// One PL455 daisy chain on its own UART, with its own link thread and work queue so a chain that
+// blocks (discovery, recovery) doesn't hold up the others. PL455Pack owns the chains.
+// The per device storage comes from PL455Chain, so every chain is sized for its own length at compile time.
 class PL455
 {
-public:
-    PL455(GPIO& gpio);
+protected:
+    PL455(GPIO& gpio, uint8_t chain, const struct device *uart, const struct gpio_dt_spec &wakeup,
+          const struct gpio_dt_spec *fault, PL455Device *devices, uint8_t maxDevices);
 
+public:
     int wakeup();
 
-    void init();
+    void init(); // blocks through wakeup and discovery, only before start() - recovery re-inits on the work queue
+    void start(int64_t firstStepTicks); // absolute uptime in ticks, so that chains can share one step grid
+    void setFaultCallback(PL455FaultCallback callback, void *context);
+    void setActivityCallback(PL455ActivityCallback callback, void *context);
+    // takes effect from the next cycle, so chains sharing a step grid stay on it
+    void setCyclePeriod(uint32_t periodUs);
+    // takes effect from the next cycle's first sample
+    void setOversampling(PL455Oversampling profile);
+    PL455Oversampling getOversampling() { return PL455Oversampling(atomic_get(&oversampling)); }
+    // window statistics since the last call with resetWindow, plus the running charge integral
+    PL455CurrentStats getCurrentStats(bool resetWindow);
+    PL455Health getHealth();
+    // The buffer must stay untouched until the capture is done. With triggerOnCurrent, the capture
+    // waits for a PL455_CAPTURE_CURRENT_STEP in the fast current samples (first chain only).
+    int startCapture(const PL455CaptureRequest &request, uint16_t *buffer, uint32_t words, bool triggerOnCurrent);
+    void cancelCapture();
+    PL455CaptureInfo getCaptureInfo();
     uint16_t getModuleVoltage(uint8_t module);
     uint16_t getCellVoltage(uint8_t module, uint8_t cell);
     uint16_t getAuxVoltage(uint8_t module, uint8_t aux);
     int getNumModules();
+    uint8_t getMaxDevices() { return maxDevices; }
     uint16_t getMinCellVoltage();
     uint16_t getMaxCellVoltage();
     uint16_t getDifCellVoltage();
-    void runBMS();
+    PL455TimingStats getTimingStats();
     bool getBalanceStatus(uint8_t module, uint8_t cell);
-    float getTemperature(uint8_t module, uint8_t sensor);
-    void fillModuleData(ModuleData& data);
+    int16_t getTemperature(uint8_t module, uint8_t sensor); // 0.1C
+    // fills this chain's devices into data starting at device slot firstSlot, returns the number of devices
+    uint8_t fillModuleData(ModuleData& data, uint8_t firstSlot);
 
 
 private:
     GPIO& mGPIO;
-    const struct device *uartDev;
+    uint8_t mChain;
+    struct k_work_q mQueue; // steps, processing and fault reads of this chain only
+    K_KERNEL_STACK_MEMBER(queueStack, PL455_BMS_STACK_SIZE);
+    PL455Uart mUart;
+    PL455Link mLink;
     struct gpio_dt_spec wakeupGPIO;
 
-    uint16_t CRC16(uint8_t *pBuf, int nLen);
-    uint8_t getInitFrame(uint8_t _readWrite, uint8_t scope, uint8_t data_size);
     uint16_t adc2volt(uint16_t adcReading);
-    float adc2temp(uint16_t adcReading);
-    void send_Frame(uint8_t *message, int messageLength);
+    int16_t adc2temp(uint16_t adcReading);
     void writeRegister(uint8_t scope, uint8_t device_addr, uint8_t register_addr, const uint8_t *data, uint8_t data_size);
-    void readRegister(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t uint8_tsToReturn);
+    int readRegister(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t uint8_tsToReturn, uint8_t *response, int size);
     void configure();
     void setAddresses();
+    void assignAddresses(uint8_t count, bool paced);
+    bool verifyAddresses(uint8_t count);
+    bool addressAnswers(uint8_t address);
+    void configureComms();
+    uint16_t configSignature();
     void findMinMaxCellVolt();
     void chooseBalanceCells();
-    void listenSerial();
-    void commReset(bool reset);
-    uint8_t numModules = 0;
-    bool rxInProgress = 0;
-    uint8_t uint8_tsToReceive = 0;
-    uint8_t uint8_tsReceived = 0;
-    uint8_t registerRequested = 0;
-    uint8_t deviceRequested = 0;
-    uint8_t scopeRequested = 0;
-    uint8_t serialRXbuffer[132];
-    bool waitingForResponse = 0;
-    bool sentRequest = 0;
-    uint16_t moduleVoltages[MAX_MODULES] = {0};    // stores module voltages (raw ADC 16bit values)
-    uint16_t cellVoltages[MAX_MODULES][NUM_CELLS] = {0};
-    uint16_t auxVoltages[MAX_MODULES][8] = {0};
+    void runBMS();
+    void processVoltages();
+    void enableBalancing();
+    void clearBalanceShadow();
+    static void onStep(struct k_work *work);
+    static void onVoltagesReady(struct k_work *work);
+    enum class Sample : uint8_t
+    {
+        Off,       // balancing off, the true cell voltages
+        On,        // balancing left on, corrected by the learned drop
+        Calibrate, // balancing on, raw reference for the off sample that follows
+    };
+    void sampleAll(Sample kind);
+    void learnBalanceDrop(uint8_t module, const uint16_t *offReadings);
+    bool balancingActive();
+    static void onVoltages(void *context, int status, uint8_t index, const uint8_t *response, int length);
+    int storeVoltages(uint8_t module, const uint8_t *response, int length); // -EIO for a response it can't use
+    void filterCells();
+    void armAutoMonitor();
+    void checkAutoMonitor();
+    void recover();
+    enum class Reinit : uint8_t
+    {
+        Idle,
+        WakeHigh,  // wakeup pin pulse
+        WakeLow,
+        Baud,      // settled, switch the baud rate
+        Configure, // general config and start autoaddressing
+        Address,   // one address per step, paced like setAddresses()
+        Probe,     // reading the addresses back one device at a time
+    };
+    static void onReinitStep(struct k_work *work);
+    void runReinit();
+    void probeAddress();
+    static void onReinitProbe(void *context, int status, uint8_t index, const uint8_t *response, int length);
+    void finishReinit();
+    bool captureActive();
+    static void onCaptureStart(struct k_work *work);
+    static void onCaptureDone(struct k_work *work);
+    void beginCapture();
+    void endCapture();
+    void requestCaptureSample();
+    static void onCaptureSample(void *context, int status, uint8_t index, const uint8_t *response, int length);
+    void writeOversampling();
+    void startFaultMonitor();
+    static void onFaultIsr(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins);
+    static void onFaultChanged(struct k_work *work);
+    void readFaults();
+    static void onFaultSummary(void *context, int status, uint8_t index, const uint8_t *response, int length);
+    static void onFaultRead(struct k_work *work);
+    void reportFaults();
+    PL455Activity evaluateActivity();
+    bool currentPathActive();
+    void selectCurrentChannel();
+    static void onCurrentTick(struct k_work *work);
+    void sampleCurrent();
+    static void onCurrent(void *context, int status, uint8_t index, const uint8_t *response, int length);
+    void storeCurrent(int32_t current);
+    PL455Device *const devices;
+    const uint8_t maxDevices;
+    uint8_t numModules = 0;        // detected, never more than maxDevices
+    bool filterPrimed = false;
+    atomic_t oversampling = ATOMIC_INIT(PL455_OVERSAMPLING);
+    uint8_t writtenOversampling = 0xFF;                    // profile the devices hold
+
+    // auto-monitor (PL455_AUTOMONITOR)
+    bool readingLast = false;          // the measurement in flight reads results instead of converting
+    bool commandNextSample = false;    // after stale results, convert on command once while auto-monitor restarts
+    uint32_t staleReads = 0;
+    uint32_t autoMonitorRearms = 0;
+
+    // recovery ladder: retry (in the link), comms break, comms reset, full re-init
+    uint8_t recoveryLevel = 0;
+    uint32_t reinits = 0;
+    Reinit reinitStage = Reinit::Idle; // the full re-init runs as steps on the work queue, never blocking it
+    uint8_t reinitIndex = 0;           // next address to hand out or read back
+    bool reinitProbeOk = false;
+    uint32_t reinitBackoffMs = 0;      // delay before the next re-init, 0 after a good measurement
+    int64_t reinitStart = 0;
     uint16_t minCellVoltage = 0;
     uint16_t maxCellVoltage = 0;
     int16_t difCellVoltage = 0;
-    bool balanceCells[MAX_MODULES][NUM_CELLS] = {0};
+    int64_t balanceRefreshMs = 0;              // uptime of the last write to every balancing device
+
+    // measure while balancing
+    Sample sampleKind = Sample::Off;
+    bool needCalibration = false;
+    bool calibrating = false;
+    uint8_t cyclesSinceOff = 0;
+    uint8_t offStep = 0;                             // step that turns balancing off this cycle, 0xFF if none
+
+    // adaptive rate
+    PL455ActivityCallback activityCallback = NULL;
+    void *activityContext = NULL;
+    uint16_t lastMaxCell = 0;
+    uint16_t lastMinCell = 0;
+    int64_t lastEvaluationMs = 0;
     uint8_t bmsStep = 0;
-    unsigned long bmsStepPeriod = 0; // microseconds
-    unsigned long bmsStepTime = 0;   // microseconds
-    elapsedMillis commTimeout;
+    int64_t bmsStepPeriod = 0;   // ticks
+    volatile uint32_t cyclePeriodUs = BMS_CYCLE_PERIOD; // set from whichever chain's queue evaluates the pack rate
+    int64_t bmsStepDeadline = 0; // ticks, absolute uptime the current step was due
     uint8_t bmsSteps;
-    uint8_t voltsRequested = 0;
+    int voltsStatus = 0;
+    PL455TimingStats timingStats = {};
+    int64_t acquisitionStart = 0; // ticks, when the sample command was queued
+    struct k_mutex dataLock;     // voltages are written by the link thread and read by fillModuleData()
+
+    struct StepWork
+    {
+        struct k_work_delayable work;
+        PL455 *owner;
+    } stepWork;
+    struct Work
+    {
+        struct k_work work;
+        PL455 *owner;
+    } voltagesWork;
+    StepWork reinitWork;
+
+    // fast current path, first chain only
+    StepWork currentWork;
+    int64_t currentDeadline = 0;   // ticks
+    int64_t lastCurrentTicks = 0;
+    bool fullScanPending = false;  // all channels selected - no current samples until it is back
+    uint32_t currentSamples = 0;
+    int32_t currentMin = 0;
+    int32_t currentMax = 0;
+    int64_t currentSum = 0;
+    uint64_t currentSumSquares = 0;
+    int64_t chargeUnits = 0;       // 0.1mA * us
+    uint32_t totalCurrentSamples = 0;
 
-    
+    // burst capture - the buffer is only written on the link thread while Running
+    atomic_t captureState = ATOMIC_INIT(int(PL455CaptureState::Idle));
+    atomic_t captureStop = ATOMIC_INIT(0); // set by cancelCapture(), polled before every conversion
+    PL455CaptureRequest captureRequest = {};
+    uint16_t *captureBuffer = NULL;
+    uint32_t captureWords = 0;
+    uint8_t captureChannels = 0;
+    uint16_t captureRecords = 0;
+    uint16_t captureRequested = 0;   // conversions asked for so far
+    uint8_t captureOutstanding = 0;  // of those, still in flight
+    uint32_t captureStartCycles = 0;
+    uint32_t captureDurationUs = 0;
+    int32_t lastCurrent = 0;
+    Work captureStartWork;
+    Work captureDoneWork;
 
-    
-};
\ No newline at end of file
+    // comparator fast protection: FAULT line ISR -> summary read on the link -> callback
+    struct gpio_dt_spec faultGPIO = {};
+    struct FaultIsr
+    {
+        struct gpio_callback callback;
+        PL455 *owner;
+    } faultIsr;
+    Work faultWork;
+    Work faultReportWork;
+    PL455FaultCallback faultCallback = NULL;
+    void *faultContext = NULL;
+    uint8_t faultFlags = 0;
+    bool faultLineActive = false;
+    bool faultReadBusy = false;
+    bool faultReadAgain = false;
+};
+
+template <uint8_t Devices>
+struct PL455Storage
+{
+    PL455Device devices[Devices] = {};
+};
+
+// A chain with room for Devices devices. The storage is a base so it exists before PL455 is built.
+template <uint8_t Devices>
+class PL455Chain : private PL455Storage<Devices>, public PL455
+{
+    static_assert(Devices >= 1 && Devices <= 16, "a PL455 chain holds 1 to 16 devices");
+    static_assert(Devices <= MAX_MODULES, "MAX_MODULES sizes the link statistics, it must cover the longest chain");
+
+public:
+    PL455Chain(GPIO& gpio, uint8_t chain, const struct device *uart, const struct gpio_dt_spec &wakeup,
+               const struct gpio_dt_spec *fault)
+        : PL455(gpio, chain, uart, wakeup, fault, PL455Storage<Devices>::devices, Devices) {}
+};
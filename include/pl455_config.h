@@ -4,16 +4,111 @@
 
 #define NUM_CELLS 16
 #define ADDR_SIZE 0 //0 is 8 bit register addresses (TI recommended), 1 is 16 bit (used by BMW)
-#define MAX_MODULES 2 //maximum of 16 modules in a pack
+#define MAX_MODULES 2 //devices on the longest chain, maximum of 16 (the PL455 limit)
+#define PL455_CHAIN0_DEVICES MAX_MODULES //devices each chain has storage for, sized at compile time
+#define PL455_CHAIN1_DEVICES MAX_MODULES
+#define PL455_CHAIN2_DEVICES MAX_MODULES
+#define MODULE_DEVICES 2 //devices one CAN node reports over all of its chains, 16 cells and 8 aux inputs each
+#define PL455_RAM_BUDGET 32768 //bytes, the whole PL455Pack (chains, link threads and work queues, capture buffer) has to fit
 #define COMM_TIMEOUT 1000 //ms, sets an error flag if we don't recieve a response to a request in this time
+#define PL455_TOPOLOGY_TIMEOUT 10 //ms, for checking the cached chain length at boot - a whole chain answers a 1 byte read well within this
+
+#define PL455_LINK_QUEUE_DEPTH 16 //transactions waiting to be sent
+#define PL455_MAX_OUTSTANDING 4 //requests allowed to wait for their response at the same time
+#define PL455_LINK_STACK_SIZE 1024
+#define PL455_LINK_PRIORITY -1 //cooperative, runs ahead of main() as soon as a response or transaction is ready
+#define PL455_BMS_STACK_SIZE 1024 //per chain, every chain has its own work queue
+#define PL455_BMS_PRIORITY 0 //balancing/measurement steps, ahead of the preemptible CAN threads
+
+#define PL455_UART_TX_BUFFER 128 //bytes of queued command frames
+#define PL455_UART_RX_BUFFER 256 //bytes of complete, CRC checked responses waiting to be read
+#define PL455_FRAME_GAP_US 1000 //us, a partially received frame is discarded after this much silence on the line
+#define PL455_RETRIES 1 //a measurement that times out is sent again this many times before the recovery ladder starts
+#define PL455_REINIT_BACKOFF_MS 1000 //ms, a chain still dead after a re-init waits this long before the next one, doubling each time
+#define PL455_REINIT_BACKOFF_MAX_MS 60000
+#define PL455_BREAK_US 60 //comms break, TX held low for at least 12 bit periods
+#define PL455_RESET_US 300 //comms reset, TX held low for at least 200us
+#define CAN_TX_PROTECTION_DEPTH 8 //frames queued per transmit priority, a full queue drops its oldest frame
+#define CAN_TX_CONTROL_DEPTH 16 //has to hold a whole reply to the inverter (9 frames)
+#define CAN_TX_TELEMETRY_DEPTH 96 //has to hold a whole telemetry publish, about 35 frames per device (legacy layout). Entries grow to 64 data bytes in CAN FD builds
+#define CAN_TX_PROTECTION_DEADLINE 1000 //ms a queued frame stays worth sending
+#define CAN_TX_CONTROL_DEADLINE 500
+#define CAN_TX_TELEMETRY_DEADLINE 200
+#define TELEMETRY_PACKED 1 //if 1, telemetry goes out four cells/ADCs per frame with a balancing bitmap (PackedFlag data types), 0 sends the legacy one value per frame layout. A two-device module publishes 20 frames instead of 65 (3.25x fewer), about 2.2x fewer bits on the bus since the packed frames carry more data each
+#define TELEMETRY_DELTA 1 //with TELEMETRY_PACKED: if 1, only the packed groups with a value that moved go out, plus a full keyframe every TELEMETRY_KEYFRAME_MS
+#define TELEMETRY_KEYFRAME_MS 10000 //ms, a master that starts up waits at most this long for a complete module
+#define TELEMETRY_CELL_DEADBAND 20 //0,1mV, a cell has to move more than this since it was last sent (or flip its balancing) to go out again
+#define TELEMETRY_ADC_DEADBAND 26 //raw ADC counts, 26 is about 2mV
+#define TELEMETRY_TEMPERATURE_DEADBAND 5 //0,1C
+#define TELEMETRY_STALE_MS 25000 //ms, the master treats a module as incomplete once a cell has gone this long without a value (2.5 keyframes)
+#define TELEMETRY_TDMA 1 //if 1, each module publishes in its own slot of a telemetry cycle that module 0 (the master) marks on CAN
+#define TELEMETRY_CYCLE_MS 400 //ms, the fastest publish period (BMS_CYCLE_PERIOD_MIN * PUBLISH_CYCLES) - a slower module skips cycles
+#define TELEMETRY_SLOTS 4 //slots per cycle, at least the number of modules - MODULE_ID picks the slot. A publish has to fit in half a slot
+#ifdef CONFIG_CAN_FD_MODE
+#define CAN_FD_TELEMETRY 1 //if 1, slave telemetry goes out as CAN FD snapshots (FdSnapshotOffset). Boards opt in with CONFIG_CAN_FD_MODE, the Pylon frames always stay classic
+#else
+#define CAN_FD_TELEMETRY 0
+#endif
+#define LINK_STATS_PUBLISH_CYCLES 10 //link health goes out on CAN once every this many telemetry publishes
+#define PL455_CRC_BENCHMARK 0 //if 1, logs CRC16 cycles per byte once at startup
+
+#define PL455_CMP_ENABLE 1 //if 1, the hardware cell comparators drive the FAULT line for fast over/under voltage protection
+#define PL455_CMP_UV_MV 2500 //comparator under voltage threshold, 700 - 4075mV in 25mV steps
+#define PL455_CMP_OV_MV 3650 //comparator over voltage threshold, 2000 - 5175mV in 25mV steps
+#define PL455_FAULT_TIMEOUT 10 //ms, for reading the fault summaries once the FAULT line changes
+
+#define PL455_CURRENT_SAMPLE_PERIOD_US 10000 //us, the current shunt (aux 7 on the first device) is sampled on its own this often between full scans, 0 disables
+#define PL455_CURRENT_TIMEOUT 5 //ms, for a single current sample
+
+#define NTC_AUX_MASK 0x7F //aux channels with a thermistor fitted, aux 7 is the current shunt
+#define NTC_BETA 3950 //thermistor beta, K
+#define NTC_R0 100000 //thermistor resistance at NTC_T0, ohms
+#define NTC_T0 290 //K
+#define NTC_RFIX 150000 //ohms, from the aux reference to each thermistor
+#define PL455_NTC_BENCHMARK 0 //if 1, logs the table and float thermistor conversion cycles once at startup
+
+#define PL455_OVERSAMPLING 1 //startup conversion profile (PL455Oversampling): 0 fast - 2x, 1 normal - 8x (recommended by TI), 2 low noise - 16x
+#define PL455_AUTOMONITOR 0 //if 1, the devices convert on their own schedule (auto-monitor) and a measurement only reads back their latest results
+#define PL455_AM_PER 0x04 //REG32 auto-monitor period code from the datasheet table, PL455_AM_PERIOD_US has to match it
+#define PL455_AM_PERIOD_US 10000 //us, the auto-monitor period - shorter than a step, so a read a step after balancing turns off sees a fresh conversion
+#define PL455_AM_STALE_READS 3 //unchanged results in a row before auto-monitor is re-armed and a conversion is commanded instead
+#define CELL_FILTER_MEDIAN 1 //if 1, the cell voltages used for protection and telemetry are the median of the last 3 readings, so a single spike never trips anything
+#define CELL_FILTER_SLOW_SHIFT 3 //balancing uses an IIR of the cell voltages, each reading moving it 1/2^n of the way. 0 balances on the protection values
+
+#define PL455_CAPTURE_WORDS 4096 //16bit words of RAM for burst captures (timestamps and readings)
+#define PL455_CAPTURE_MAX_MS 5000 //longest burst capture
+#define PL455_CAPTURE_PIPELINE 2 //burst capture conversions in flight at once, so the link never sits idle between them
+#define PL455_CAPTURE_TIMEOUT 10 //ms, for one burst capture conversion
+#define PL455_CAPTURE_CURRENT_STEP 50000 //0.1mA, a change this big between two fast current samples fires an armed capture
+#define CAPTURE_FRAMES_PER_PASS 16 //capture data frames sent per slave worker pass while a read is pending
+
+#define PL455_EMUL_DEVICES 2 //native_sim only: devices in the emulated chain, up to 16
+#define PL455_EMUL_CELL_MV 3300 //native_sim only: starting cell voltage, each cell a little above it
+#define PL455_EMUL_CHANNEL_US 13 //native_sim only: conversion time per channel per oversample
+#define PL455_EMUL_BALANCE_DROP 200 //native_sim only: 0.1mV a cell reads low while its balance switch is on
+#define PL455_EMUL_BALANCE_DRIFT 1 //native_sim only: 0.1mV a balancing cell runs down per conversion
+#define PL455_EMUL_STACK_SIZE 2048
+#define PL455_EMUL_PRIORITY -2 //cooperative, answers ahead of the link thread like real hardware would
 
 #define CELL_IGNORE_VOLT 5000 //ADC readings below this number will result in the cell being ignored for min and average etc calcuations. 5000 is 381mV, which should be plenty high enough to ignore disconnected cells
 #define BALANCE_TOLERANCE 26 //Balance will not be enabled for cells <2mV away from the min cell voltage. 26 is 2mV
+#define BALANCE_HYSTERESIS 13 //A balancing cell stays on until it is this much closer to the min cell than BALANCE_TOLERANCE. 13 is 1mV
 #define BALANCE_DUTYCYCLE 90 //Percent, approximate!
 #define BALANCE_MIN_VOLT 39321 //ADC readings below this number will preclude balancing. 39321 is 3.0V
+#define BALANCE_MEASURE_WHILE_ON 1 //if 1, cells are measured with balancing left on and corrected for the bleed resistor drop
+#define BALANCE_OFF_MEASURE_CYCLES 10 //with BALANCE_MEASURE_WHILE_ON, one cycle in this many still measures with balancing off and recalibrates the drop
 #define BALANCE_WHILE_CHARGE 1 //if 1, the BMS will always balance while charging (current < 0), even if voltages are low
 
-#define BMS_CYCLE_PERIOD 500000 //microseconds, you get a voltage reading approximately this often (actually, the time between voltages will always be greater due to sampling times and delays)
+#define BMS_CYCLE_PERIOD 500000 //microseconds, you get a voltage reading this often. Steps run on a fixed grid of BMS_CYCLE_PERIOD / steps
+#define BMS_CYCLE_PERIOD_MIN 200000 //microseconds, fastest rate - high current, a cell close to a limit or moving quickly
+#define BMS_CYCLE_PERIOD_MAX 2000000 //microseconds, slowest rate - pack at rest
+#define RATE_FAST_CURRENT 100000 //0.1mA, 10A or more selects BMS_CYCLE_PERIOD_MIN
+#define RATE_REST_CURRENT 5000 //0.1mA, below 0.5A (with nothing else going on) selects BMS_CYCLE_PERIOD_MAX
+#define RATE_FAST_CELL_HIGH 46530 //ADC readings above this select BMS_CYCLE_PERIOD_MIN. 46530 is 3.55V, 50mV below the master's high voltage alarm
+#define RATE_FAST_CELL_LOW 36044 //ADC readings below this select BMS_CYCLE_PERIOD_MIN. 36044 is 2.75V, 50mV above the master's low voltage alarm
+#define RATE_FAST_DVDT 131 //ADC counts per second on the min or max cell that select BMS_CYCLE_PERIOD_MIN. 131 is 10mV/s
+#define RATE_RELAX_MS 10000 //ms, the rate only drops again after things have been calm this long
+#define PUBLISH_CYCLES 2 //telemetry goes out once every this many acquisition cycles
 
 #define REPORTING_PERIOD 1000 //milliseconds - you get an status output this frequently.
 #define VOLTS_DECIMALS 3 //decimal points used for voltage reporting
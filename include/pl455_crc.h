@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "pl455_config.h"
+
+// CRC16 for PL455 - ITU_T polynomial: x^16 + x^15 + x^2 + 1 (reflected, init 0)
+// A frame including its two trailing CRC bytes checks to 0.
+uint16_t CRC16(const uint8_t *message, int length);
+
+extern const uint16_t crc16_table[256];
+
+// Folds one more byte into a running CRC - used by the receiver to check frames as they arrive
+static inline uint16_t CRC16Update(uint16_t crc, uint8_t data)
+{
+    return crc16_table[(crc ^ data) & 0x00FF] ^ (crc >> 8);
+}
+
+#if PL455_CRC_BENCHMARK
+// Logs cycles per byte for the bitwise, byte table and slicing-by-4 CRCs
+void CRC16Benchmark();
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "pl455_config.h"
+
+// Model of a PL455 daisy chain behind the "zephyr,uart-emul" UART of native_sim (see
+// boards/native_sim.overlay), so PL455 runs unchanged off the board. It answers auto-addressing,
+// register reads and writes and conversions, checks and adds CRCs, and takes as long as the
+// frames would on the wire at the configured baud rate.
+
+enum class PL455EmulFault : uint8_t
+{
+    DropByte, // a byte goes missing from the middle of the response
+    BadCrc,   // the response arrives with a broken CRC
+    Silent,   // the device doesn't answer at all
+};
+
+#define PL455_EMUL_FOREVER UINT16_MAX
+
+// applies fault to the next count responses of the device at chain position device, 0 clears it
+void PL455EmulInject(PL455EmulFault fault, uint8_t device, uint16_t count);
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pl455_config.h"
+#include "pl455_crc.h"
+
+#define SCOPE_SINGLE 0
+#define SCOPE_GROUP 1
+#define SCOPE_BRDCST 3
+
+// Command frame init byte: bit 7 frame type (always 1 here, 0 is a response back from the PL455s),
+// bits 6 - 4 request type (scope << 1, plus 1 if no response is wanted), bit 3 address size,
+// bits 2 - 0 data size (7 means 8 bytes - the PL455 doesn't accept 7 bytes of data)
+constexpr uint8_t PL455InitByte(bool noResponse, uint8_t scope, uint8_t dataSize)
+{
+    return (1 << 7) | (((scope << 1) | (noResponse ? 1 : 0)) << 4) | (ADDR_SIZE << 3) | (dataSize == 8 ? 7 : dataSize);
+}
+
+constexpr bool PL455ValidDataSize(uint8_t dataSize)
+{
+    return (dataSize <= 6) || (dataSize == 8);
+}
+
+// Bitwise version of CRC16() for frames built at compile time
+constexpr uint16_t PL455ConstCRC16(const uint8_t *message, int length)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < length; i++)
+    {
+        crc ^= message[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+// Writes a command frame - header, payload and CRC - in place into one buffer
+class PL455FrameBuilder
+{
+public:
+    constexpr PL455FrameBuilder(uint8_t *buffer) : frame(buffer) {}
+
+    // init byte, device or group ID (not for broadcast), register address (2 bytes if ADDR_SIZE=1)
+    constexpr void header(bool noResponse, uint8_t scope, uint8_t dataSize, uint8_t deviceOrGroup, uint8_t reg)
+    {
+        frame[size++] = PL455InitByte(noResponse, scope, dataSize);
+        if (scope != SCOPE_BRDCST)
+        {
+            frame[size++] = deviceOrGroup;
+        }
+        if (ADDR_SIZE)
+        {
+            frame[size++] = 0;
+        }
+        frame[size++] = reg;
+    }
+
+    constexpr void byte(uint8_t data)
+    {
+        frame[size++] = data;
+    }
+
+    // register data is kept LS byte first (like the REGxx tables) but goes on the wire MS byte first
+    constexpr void data(const uint8_t *data, uint8_t dataSize)
+    {
+        for (uint8_t i = 0; i < dataSize; i++)
+        {
+            frame[size++] = data[dataSize - i - 1];
+        }
+    }
+
+    // appends the CRC and returns the complete frame length
+    constexpr int finish()
+    {
+        uint16_t crc = __builtin_is_constant_evaluated() ? PL455ConstCRC16(frame, size) : CRC16(frame, size);
+        frame[size++] = crc & 0x00FF;
+        frame[size++] = (crc & 0xFF00) >> 8;
+        return size;
+    }
+
+private:
+    uint8_t *frame;
+    int size = 0;
+};
+
+#define PL455_MAX_COMMAND_FRAME (1 + 1 + 2 + 8 + 2) // init, device/group, register, data, CRC
+
+template <size_t Size>
+struct PL455ConstFrame
+{
+    uint8_t bytes[Size];
+};
+
+// Broadcast register write without response, CRC included, built at compile time
+template <size_t DataSize>
+constexpr PL455ConstFrame<DataSize + 4 + ADDR_SIZE> PL455BroadcastWrite(uint8_t reg, const uint8_t (&data)[DataSize])
+{
+    static_assert(PL455ValidDataSize(DataSize), "PL455 frames carry 0-6 or 8 bytes of data");
+    PL455ConstFrame<DataSize + 4 + ADDR_SIZE> frame = {};
+    PL455FrameBuilder builder(frame.bytes);
+    builder.header(true, SCOPE_BRDCST, DataSize, 0, reg);
+    builder.data(data, DataSize);
+    builder.finish();
+    return frame;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include "pl455_config.h"
+#include "pl455_uart.h"
+#include "pl455_frame.h"
+
+enum class PL455Op : uint8_t
+{
+    Write,   // register write, no response
+    Read,    // register read, one response per device addressed
+    Command, // register write that asks for a response (e.g. sample and send)
+    Break,   // comms break, TX low for PL455_BREAK_US - the devices drop any partly received command
+    Reset,   // comms reset, TX low for PL455_RESET_US - the devices restart their comms
+};
+
+// Called once per response frame (index counts from 0), or once with a negative status when
+// the transaction times out or can't be sent (-EINVAL). Writes without a response are completed with index 0 once sent.
+// Runs on the link thread - keep it short.
+typedef void (*PL455Callback)(void *context, int status, uint8_t index, const uint8_t *response, int length);
+
+struct PL455Transaction
+{
+    PL455Op op;
+    uint8_t scope;
+    uint8_t device;        // device address, or the highest device address for group/broadcast responses
+    uint8_t group;
+    uint8_t reg;
+    uint8_t dataSize;
+    uint8_t data[8];       // LS byte first, same as the REGxx tables
+    uint8_t responses;     // number of response frames expected
+    uint8_t responseSize;  // bytes in each of them, init byte and CRC included. 0 takes any size.
+                           // A frame of another size fails every request in flight with -EBADMSG.
+    uint16_t timeout;      // ms, measured from when it is sent or, behind other requests, from when they are done
+    uint8_t retries;       // times the request is sent again after a timeout, when nothing else is in flight.
+                           // The responses are delivered again from index 0.
+    const uint8_t *frame;  // prebuilt frame (CRC included) streamed as is instead of building one from the fields above
+    uint8_t frameSize;
+    PL455Callback callback;
+    void *context;
+};
+
+// link health counters since start up
+struct PL455LinkStats
+{
+    uint32_t timeouts[MAX_MODULES];  // responses a device never gave
+    uint32_t crcErrors[MAX_MODULES]; // of those, the ones where a frame arrived but failed its CRC
+    uint32_t retries;
+    uint32_t breaks;
+    uint32_t resets;
+};
+
+// Transaction engine for one PL455 daisy chain.
+// Transactions are queued by any thread and sent by the link thread at line rate. Writes go out
+// back to back; requests that need a response stay in flight (up to PL455_MAX_OUTSTANDING of them)
+// and are matched to responses in order, since the chain answers in the order it was asked.
+class PL455Link
+{
+public:
+    PL455Link(PL455Uart &uart);
+
+    // Queues a transaction, waiting up to COMM_TIMEOUT for room in the queue. Callbacks, which run on
+    // the link thread, must pass K_NO_WAIT - the link can't make room while it waits on itself.
+    int submit(const PL455Transaction &transaction, k_timeout_t wait = K_MSEC(COMM_TIMEOUT));
+
+    // Convenience for reads/writes that fit in one response: submits and waits for completion.
+    // Returns the response length (0 for writes) or a negative error code.
+    int transfer(PL455Transaction transaction, uint8_t *response, int size);
+
+    // Convenience builders
+    int write(uint8_t scope, uint8_t device_addr, uint8_t register_addr, const uint8_t *data, uint8_t data_size);
+    int read(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t bytesToReturn, uint8_t *response, int size);
+
+    // Queues a comms break or reset (PL455Op::Break or PL455Op::Reset), in order with everything else
+    int sendBreak(PL455Op op);
+
+    PL455LinkStats getStats();
+
+    // Queues a prebuilt frame without a response. The frame must stay valid until it is sent -
+    // meant for the constexpr frames that live in flash.
+    int writeFrame(const uint8_t *frame, uint8_t size);
+    template <size_t Size>
+    int write(const PL455ConstFrame<Size> &frame)
+    {
+        return writeFrame(frame.bytes, Size);
+    }
+
+private:
+    PL455Uart &mUart;
+
+    struct InFlight
+    {
+        PL455Transaction transaction;
+        uint8_t received;
+        int64_t deadline; // set again when it becomes the head
+    };
+
+    static void threadEntry(void *link, void *, void *);
+    void run();
+    void startQueued();
+    void deliver(const uint8_t *response, int length);
+    void expire();
+    void popHead();
+    void resync();
+    int send(const PL455Transaction &transaction); // -EINVAL for a frame the devices can't take, nothing sent
+
+    void countTimeout(const InFlight &timedOut);
+
+    struct k_msgq queue;
+    char queueBuffer[PL455_LINK_QUEUE_DEPTH * sizeof(PL455Transaction)] __aligned(4);
+
+    InFlight inFlight[PL455_MAX_OUTSTANDING];
+    uint8_t inFlightHead = 0;
+    uint8_t inFlightCount = 0;
+
+    PL455LinkStats stats = {};
+    uint32_t lastCrcErrors = 0; // UART CRC errors already put down to a device
+
+    struct k_thread thread;
+    K_KERNEL_STACK_MEMBER(stack, PL455_LINK_STACK_SIZE);
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include "pl455_config.h"
+
+// NTC thermistor on a PL455 aux input: Rfix from the aux reference to the input, NTC to ground.
+// Converted through a table generated at compile time from the beta equation (NTC_* in
+// pl455_config.h) and linearly interpolated - no floats or logf at runtime.
+
+// ADC reading to temperature in 0.1C
+int16_t NTCTemperature(uint16_t adcReading);
+
+#if PL455_NTC_BENCHMARK
+// Logs cycles per conversion for the float beta equation and the table, and the worst difference
+void NTCBenchmark();
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include "pl455.h"
+
+// Chains are picked up from the devicetree: bquart/bqwakeup is the first one and must exist,
+// bquart1 and bquart2 add a chain each on another USIC channel. A chain without its own
+// bqwakeupN alias shares the first chain's wakeup pin.
+#define BQUART_NODE DT_ALIAS(bquart)
+#define BQUART1_NODE DT_ALIAS(bquart1)
+#define BQUART2_NODE DT_ALIAS(bquart2)
+
+#define PL455_NUM_CHAINS (1 + DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE) + DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE))
+
+class PL455Pack;
+#ifdef CONFIG_SHELL
+// "pl455" shell commands act on this pack
+void PL455ShellAttach(PL455Pack &pack);
+#endif
+
+// Called on the work queue of the chain whose FAULT line changed, with the ProtectionFlag bits of all chains together
+typedef void (*PL455PackFaultCallback)(void *context, uint8_t flags);
+
+// All PL455 chains of this module. Every chain has its own UART, link thread, work queue and
+// step timing, but they start on the same step grid, so they sample in parallel and a cycle
+// takes as long as the longest chain.
+class PL455Pack
+{
+public:
+    // faultCallback reports the hardware comparators, it may be called as soon as the chains are started
+    PL455Pack(GPIO &gpio, PL455PackFaultCallback faultCallback = NULL, void *faultContext = NULL);
+
+    // merges every chain into one view, devices numbered in chain order. Every chain has a fixed
+    // range of slots (PL455_CHAINn_DEVICES), so a chain losing a device doesn't renumber the ones after it.
+    void fillModuleData(ModuleData &data);
+
+    // current acquisition rate, picked from how busy the chains are
+    uint32_t getCyclePeriodUs() { return cyclePeriodUs; }
+    uint32_t getPublishPeriodMs() { return (cyclePeriodUs / 1000) * PUBLISH_CYCLES; }
+
+    // REG07 conversion profile for every chain, from the next cycle on
+    void setOversampling(PL455Oversampling profile);
+
+    // Burst capture into the pack's buffer, one chain at a time. A new capture discards the last one.
+    int startCapture(uint8_t chain, const PL455CaptureRequest &request, bool triggerOnCurrent);
+    void cancelCapture();
+    // the chain the buffer belongs to, or -1 if there's none
+    int getCaptureChain() { return captureChain; }
+    // copies words from a finished capture (see PL455CaptureInfo for the layout), returns the number copied
+    int readCapture(uint32_t offset, uint16_t *words, uint32_t count);
+
+    int getNumChains() { return PL455_NUM_CHAINS; }
+    PL455 &getChain(int chain) { return *mChains[chain]; }
+    // ModuleData device slot of the chain's first device
+    uint8_t getFirstSlot(int chain);
+
+private:
+    PL455Chain<PL455_CHAIN0_DEVICES> mChain0;
+#if DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE)
+    PL455Chain<PL455_CHAIN1_DEVICES> mChain1;
+#endif
+#if DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE)
+    PL455Chain<PL455_CHAIN2_DEVICES> mChain2;
+#endif
+    PL455 *mChains[PL455_NUM_CHAINS];
+
+    static void onChainFault(void *context, uint8_t chain, uint8_t flags);
+    static void onChainActivity(void *context, uint8_t chain, PL455Activity activity);
+    struct k_mutex chainLock; // the chain callbacks come from one work queue per chain
+    PL455Activity chainActivity[PL455_NUM_CHAINS] = {};
+    PL455Activity activity = PL455Activity::Normal;
+    int64_t calmSinceMs = 0;
+    volatile uint32_t cyclePeriodUs = BMS_CYCLE_PERIOD;
+    uint8_t chainFaults[PL455_NUM_CHAINS] = {0};
+    PL455PackFaultCallback faultCallback;
+    void *faultContext;
+
+    struct k_mutex captureLock; // a capture can't start while the buffer is being read
+    int captureChain = -1;
+    uint16_t captureBuffer[PL455_CAPTURE_WORDS];
+};
+
+#define PL455_PACK_DEVICES (PL455_CHAIN0_DEVICES + \
+                            (DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE) ? PL455_CHAIN1_DEVICES : 0) + \
+                            (DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE) ? PL455_CHAIN2_DEVICES : 0))
+static_assert(PL455_PACK_DEVICES <= ModuleData::devices,
+              "the chains hold more devices than ModuleData reports, raise MODULE_DEVICES");
+static_assert(sizeof(PL455Pack) <= PL455_RAM_BUDGET,
+              "PL455Pack is over PL455_RAM_BUDGET, shorten the chains or PL455_CAPTURE_WORDS");
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// What auto-addressing found on a chain last time, kept in the settings partition so a reset
+// doesn't have to rediscover it. configSignature changes with the register configuration,
+// which invalidates the entry whenever the firmware configures the devices differently.
+struct PL455Topology
+{
+    uint8_t numModules;
+    uint16_t configSignature;
+};
+
+// Returns 0 and fills topology if chain has a cached entry, negative error code otherwise.
+int PL455TopologyLoad(uint8_t chain, PL455Topology &topology);
+int PL455TopologySave(uint8_t chain, const PL455Topology &topology);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/ring_buffer.h>
+#include "pl455_config.h"
+
+#define PL455_MAX_FRAME 131 // init byte, up to 128 data bytes, 2 CRC bytes
+
+struct PL455UartStats
+{
+    uint32_t framesReceived;
+    uint32_t crcErrors;
+    uint32_t noiseBytes;   // bytes received outside of a response frame
+    uint32_t rxOverflows;  // complete frames dropped because the RX ring was full
+};
+
+// Interrupt driven transport for the PL455 daisy chain.
+// TX bytes are queued into a ring buffer and pushed into the USIC FIFO from the ISR.
+// RX bytes are assembled into frames inside the ISR; only complete, CRC checked
+// responses are committed to the RX ring buffer and signalled to the reader.
+class PL455Uart
+{
+public:
+    PL455Uart(const struct device *uart);
+
+    // Queues a complete frame (including CRC) for transmission. Blocks only while the TX ring is full.
+    int send(const uint8_t *data, int length);
+
+    // Waits for a complete response frame. Returns the frame length, or -EAGAIN on timeout.
+    int receive(uint8_t *frame, int size, k_timeout_t timeout);
+
+    // Drops every response that has not been read yet.
+    void flush();
+
+    // Holds TX low for lowUs once everything queued has gone out (a comms break or reset),
+    // by sending a zero byte at a baud rate slow enough. Drops any partly received frame.
+    int sendBreak(uint32_t lowUs);
+
+    // Available whenever a complete response is waiting, for use with k_poll().
+    struct k_sem *rxSignal() { return &rxFrames; }
+
+    PL455UartStats getStats();
+
+private:
+    const struct device *uartDev;
+
+    static void isr(const struct device *dev, void *user_data);
+    void assemble(uint8_t data);
+
+    struct ring_buf txRing;
+    struct ring_buf rxRing;
+    uint8_t txBuffer[PL455_UART_TX_BUFFER];
+    uint8_t rxBuffer[PL455_UART_RX_BUFFER];
+    struct k_sem txSpace;
+    struct k_sem rxFrames;
+
+    // frame assembler state, only touched from the ISR
+    uint8_t rxFrame[PL455_MAX_FRAME];
+    uint8_t rxReceived = 0;
+    uint8_t rxExpected = 0;
+    uint16_t rxCrc = 0;     // running CRC of the bytes received so far, 0 once a good frame is complete
+    uint32_t rxLastByte = 0;
+
+    PL455UartStats stats = {};
+};
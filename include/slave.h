@@ -1,20 +1,69 @@
 #pragma once
 
 #include "module_data.h"
-#include "pl455.h"
+#include "pl455_pack.h"
 #include "gpio.h"
 #include "elapsedmillis.h"
 
+// Called when the hardware comparators trip or clear, before the protection frame goes out on CAN
+typedef void (*ProtectionHook)(uint8_t moduleId, uint8_t flags);
+
 class Slave
 {
     public:
-    Slave(ModuleData& moduleData, uint8_t id, GPIO &gpio);
+    Slave(ModuleData& moduleData, uint8_t id, GPIO &gpio, ProtectionHook protectionHook = NULL);
     bool worker();
+    // CaptureOffset frames from the host, safe to call from the CAN receive callback
+    void onCaptureMessage(uint32_t id, const uint8_t *data, uint8_t dataLen);
+    // module 0's CycleMarker, safe to call from the CAN receive callback
+    void onCycleMarker(const uint8_t *data, uint8_t dataLen);
 
     private:
+    static void onProtection(void *context, uint8_t flags);
+    bool publishDue();
+    void sendCurrent(uint32_t base);
+    void sendLegacy(uint32_t base);
+    bool telemetryLost();
+    void sendPackedTemperatures(uint32_t base, bool keyframe);
+    void sendPacked(uint32_t base, bool keyframe);
+    void sendFd(uint32_t base);
+    void sendLinkStats(uint32_t base);
+    void serviceCapture(uint32_t base);
+    void sendCaptureStatus(uint32_t base, const PL455CaptureInfo &info);
+
     uint8_t mId;
     ModuleData &mData;
-    PL455 mBalancer;
+    ProtectionHook mProtectionHook;
+    PL455Pack mBalancer;
     GPIO& mGPIO;
     elapsedMillis lastUpdate;
+    uint8_t publishCount = 0;
+
+    // what the master was last sent, for TELEMETRY_DELTA
+    struct
+    {
+        uint16_t cells[ModuleData::cells];
+        uint32_t balancing[(ModuleData::cells + 31) / 32];
+        uint16_t adcs[ModuleData::auxes];
+        int16_t temperatures[ModuleData::auxes];
+    } sent = {};
+    elapsedMillis sinceKeyframe{TELEMETRY_KEYFRAME_MS}; // the first round is a keyframe
+    uint32_t txLosses = 0; // CAN TX frames lost up to the last round
+
+    // telemetry cycle (TELEMETRY_TDMA), the last marker extrapolated while none arrive
+    uint32_t markerMs = 0;
+    uint16_t cycleMs = TELEMETRY_CYCLE_MS;
+    uint8_t cycleSlots = TELEMETRY_SLOTS;
+    uint8_t markerSequence = 0;
+
+    struct CaptureMessage
+    {
+        uint8_t channel;
+        uint8_t data[8];
+    };
+    struct k_msgq captureQueue;
+    CaptureMessage captureQueueBuffer[4];
+    PL455CaptureState lastCaptureState = PL455CaptureState::Idle;
+    uint32_t readOffset = 0; // next word of a CaptureRead still to go out
+    uint32_t readEnd = 0;
 };
\ No newline at end of file
@@ -5,6 +5,11 @@ Each module uses a base address 0x1000 * moduleId.
 - Cell data messages are at baseAddress + cell (0-31) and contain:
     struct CellState { uint16_t voltage; uint8_t balancing; }
 - ADC raw value messages are at baseAddress + 0x100 + number (0-15) and contain a uint16_t value.
+- Offsets with 0x800 set are the packed layout (TELEMETRY_PACKED), channel n in the low byte:
+    0x800 + n: uint16_t voltage[4] of cells 4n to 4n + 3
+    0x900 + n: uint32_t balancing bitmap of cells 32n to 32n + 31
+    0xA00 + n: uint16_t adc[4] of inputs 4n to 4n + 3
+    0xB00 + n: int16_t temperature[4] of inputs 4n to 4n + 3, 0.1C, -32768 without a thermistor
 - Module state messages are at baseAddress + 0x200 and contain:
     struct ModuleState {
         uint16_t m1Voltage;
@@ -35,6 +40,8 @@ MQTT_TOPIC_PREFIX = "homeassistant/sensor"  # Base topic for Home Assistant sens
 # CAN bus settings
 CAN_CHANNEL = "can0"
 CAN_BITRATE = 250000  # Adjust this if needed
+FD_CELLS = 32  # cells and ADC inputs per module (MODULE_DEVICES * 16 and * 8), for the CAN FD snapshot
+FD_AUXES = 16
 
 # ----- Global data store -----
 # This dictionary will store the data per module
@@ -107,6 +114,74 @@ def process_can_message(msg):
             }
             # print(f"Module {module_id} - Module State: m1Voltage = {m1Voltage/100.0} V, m2Voltage = {m2Voltage/100.0} V, CellDiff = {cellDiff}")
 
+    elif (offset & 0xF00) in (0x600, 0x700, 0xD00):
+        # link stats, burst capture traffic and the telemetry cycle marker - nothing to publish
+        return
+    elif (offset & 0xF00) == 0x300:
+        # protection: the hardware comparators, bit 0 under voltage, bit 1 over voltage
+        if len(msg.data) >= 1:
+            modules[module_id]["module"]["protection"] = msg.data[0]
+    elif (offset & 0xF00) == 0x400:
+        # fast current samples: channel 0 min/max/mean/rms in 10mA, channel 1 charge in mAs and sample count
+        if (offset & 0xFF) == 0 and len(msg.data) >= 8:
+            minimum, maximum, mean, rms = struct.unpack("<hhhH", msg.data[:8])
+            modules[module_id]["module"]["current_mean"] = mean * 10
+            modules[module_id]["module"]["current_rms"] = rms * 10
+        elif (offset & 0xFF) == 1 and len(msg.data) >= 8:
+            charge, samples = struct.unpack("<iI", msg.data[:8])
+            modules[module_id]["module"]["charge_mAs"] = charge
+    elif (offset & 0xF00) == 0x500:
+        # one thermistor, channel device * 8 + aux, 0.1C
+        if len(msg.data) >= 2:
+            (temperature,) = struct.unpack("<h", msg.data[:2])
+            modules[module_id].setdefault("temperatures", {})[offset & 0xFF] = temperature / 10.0
+    elif (offset & 0xF00) == 0xC00:
+        # CAN FD snapshot (CAN_FD_TELEMETRY), 64 byte segments of: module state, balancing bitmap,
+        # cell voltages, ADC values - sized for FD_CELLS cells and FD_AUXES inputs
+        segments = modules[module_id].setdefault("fd_segments", {})
+        segments[offset & 0xFF] = bytes(msg.data)
+        snapshot = b"".join(segments.get(i, b"") for i in range(len(segments)))
+        words = (FD_CELLS + 31) // 32
+        size = 8 + 4 * words + 2 * (FD_CELLS + FD_AUXES)
+        if len(snapshot) >= size:
+            del modules[module_id]["fd_segments"]
+            balancing = struct.unpack_from(f"<{words}I", snapshot, 8)
+            voltages = struct.unpack_from(f"<{FD_CELLS}H", snapshot, 8 + 4 * words)
+            adcs = struct.unpack_from(f"<{FD_AUXES}H", snapshot, 8 + 4 * words + 2 * FD_CELLS)
+            for cell, voltage in enumerate(voltages):
+                modules[module_id]["cells"][cell] = {
+                    "voltage": voltage / 10000.0,
+                    "balancing": (balancing[cell // 32] >> (cell % 32)) & 1
+                }
+            for adc, adc_raw in enumerate(adcs):
+                modules[module_id]["adc"][adc] = adc_raw
+        else:
+            return
+    elif offset & 0x800:
+        # Packed layout (TELEMETRY_PACKED): four values per frame, balancing as a bitmap
+        data_type = offset & 0xF00
+        channel = offset & 0xFF
+        if data_type == 0x800 and len(msg.data) >= 8:
+            for i, voltage in enumerate(struct.unpack("<4H", msg.data[:8])):
+                cell = modules[module_id]["cells"].setdefault(channel * 4 + i, {"balancing": 0})
+                cell["voltage"] = voltage / 10000.0
+        elif data_type == 0x900 and len(msg.data) >= 4:
+            (bitmap,) = struct.unpack("<I", msg.data[:4])
+            for i in range(32):
+                cell = modules[module_id]["cells"].setdefault(channel * 32 + i, {"voltage": 0})
+                cell["balancing"] = (bitmap >> i) & 1
+        elif data_type == 0xA00 and len(msg.data) >= 8:
+            for i, adc_raw in enumerate(struct.unpack("<4H", msg.data[:8])):
+                modules[module_id]["adc"][channel * 4 + i] = adc_raw
+        elif data_type == 0xB00 and len(msg.data) >= 8:
+            temperatures = modules[module_id].setdefault("temperatures", {})
+            for i, temperature in enumerate(struct.unpack("<4h", msg.data[:8])):
+                if temperature != -32768:  # no thermistor fitted
+                    temperatures[channel * 4 + i] = temperature / 10.0
+        else:
+            print(f"Module {module_id}: Unknown message offset {hex(offset)}")
+            return
+
     else:
         print(f"Module {module_id}: Unknown message offset {hex(offset)}")
         return
@@ -124,7 +199,7 @@ def process_can_message(msg):
 def main():
     try:
         # Set up the CAN bus interface
-        bus = can.interface.Bus(channel=CAN_CHANNEL, bustype="socketcan", bitrate=CAN_BITRATE)
+        bus = can.interface.Bus(channel=CAN_CHANNEL, bustype="socketcan", bitrate=CAN_BITRATE, fd=True)
         print("Listening on CAN bus channel:", CAN_CHANNEL)
         while True:
             msg = bus.recv(timeout=1.0)
@@ -1,4 +1,5 @@
 #include "can.h"
+#include "pl455_config.h"
 #include <zephyr/kernel.h>
 #include <zephyr/sys/printk.h>
 #include <zephyr/device.h>
@@ -11,30 +12,200 @@
 #define STATE_POLL_THREAD_STACK_SIZE 512
 #define STATE_POLL_THREAD_PRIORITY 2
 #define SLEEP_TIME K_MSEC(250)
+#define TX_THREAD_STACK_SIZE 512
+#define TX_THREAD_PRIORITY 1 // ahead of RX, so replies never wait behind a burst of requests
+#define TX_MAILBOXES 3       // frames handed to the controller at once
+#define TX_RETRIES 3         // a frame the controller failed to send goes back to the front of its queue this often
+#define TX_BUS_OFF_BACKOFF K_MSEC(10)
 
 K_THREAD_STACK_DEFINE(rx_thread_stack, RX_THREAD_STACK_SIZE);
 K_THREAD_STACK_DEFINE(poll_state_stack, STATE_POLL_THREAD_STACK_SIZE);
+K_THREAD_STACK_DEFINE(tx_thread_stack, TX_THREAD_STACK_SIZE);
 
 const struct device *const can_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus));
 
 struct k_thread rx_thread_data;
 struct k_thread poll_state_thread_data;
+struct k_thread tx_thread_data;
 struct k_work state_change_work;
 enum can_state current_state;
 struct can_bus_err_cnt current_err_cnt;
 
 CAN_MSGQ_DEFINE(counter_msgq, 64);
 
-void tx_irq_callback(const struct device *dev, int error, void *arg)
+// Transmit queues, one ring per priority. A full ring drops its oldest frame - the newest
+// telemetry is the one worth sending, and one class filling up never crowds out another.
+struct tx_entry
+{
+    uint32_t id;
+    uint32_t deadline; // k_uptime_get_32(), dropped unsent after this
+    uint8_t data[CAN_MAX_DLEN]; // 64 bytes in CAN FD builds
+    uint8_t length;
+    uint8_t retries;
+    uint8_t priority;
+    bool fd;
+};
+
+struct tx_ring
+{
+    struct tx_entry *entries;
+    uint8_t size;
+    uint8_t head;
+    uint8_t count;
+    uint16_t deadlineMs;
+};
+
+static struct tx_entry tx_protection[CAN_TX_PROTECTION_DEPTH];
+static struct tx_entry tx_control[CAN_TX_CONTROL_DEPTH];
+static struct tx_entry tx_telemetry[CAN_TX_TELEMETRY_DEPTH];
+static struct tx_ring tx_rings[CAN_PRIO_COUNT] = {
+    {tx_protection, ARRAY_SIZE(tx_protection), 0, 0, CAN_TX_PROTECTION_DEADLINE},
+    {tx_control, ARRAY_SIZE(tx_control), 0, 0, CAN_TX_CONTROL_DEADLINE},
+    {tx_telemetry, ARRAY_SIZE(tx_telemetry), 0, 0, CAN_TX_TELEMETRY_DEADLINE},
+};
+static struct tx_entry tx_in_flight[TX_MAILBOXES];
+static uint8_t tx_in_flight_used; // bit per tx_in_flight slot
+static struct k_spinlock tx_lock;
+static struct CAN_TxStats tx_stats;
+static bool fd_active;
+K_SEM_DEFINE(tx_queued, 0, K_SEM_MAX_LIMIT);
+K_SEM_DEFINE(tx_mailboxes, TX_MAILBOXES, TX_MAILBOXES);
+
+static bool tx_expired(const struct tx_entry *entry)
+{
+    return (int32_t)(k_uptime_get_32() - entry->deadline) >= 0;
+}
+
+// both called with tx_lock held
+static void tx_push(const struct tx_entry *entry, bool front)
 {
-    char *sender = (char *)arg;
+    struct tx_ring *ring = &tx_rings[entry->priority];
+    bool full = (ring->count == ring->size);
+    if (full)
+    {
+        tx_stats.dropped[entry->priority]++;
+        if (front)
+        {
+            return; // a retry only goes back in if there is room
+        }
+        ring->head = (ring->head + 1) % ring->size;
+        ring->count--;
+    }
+    if (front)
+    {
+        ring->head = (ring->head + ring->size - 1) % ring->size;
+        ring->entries[ring->head] = *entry;
+    }
+    else
+    {
+        ring->entries[(ring->head + ring->count) % ring->size] = *entry;
+    }
+    ring->count++;
+    if (!full)
+    {
+        k_sem_give(&tx_queued);
+    }
+}
 
+static bool tx_pop(struct tx_entry *entry)
+{
+    for (int priority = 0; priority < CAN_PRIO_COUNT; priority++)
+    {
+        struct tx_ring *ring = &tx_rings[priority];
+        if (ring->count != 0)
+        {
+            *entry = ring->entries[ring->head];
+            ring->head = (ring->head + 1) % ring->size;
+            ring->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tx_done(struct tx_entry *slot, int error)
+{
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    if (error == 0)
+    {
+        tx_stats.sent++;
+    }
+    else if ((slot->retries < TX_RETRIES) && !tx_expired(slot))
+    {
+        slot->retries++;
+        tx_stats.retries++;
+        tx_push(slot, true);
+    }
+    else
+    {
+        tx_stats.failed++;
+    }
+    tx_in_flight_used &= ~BIT(slot - tx_in_flight);
+    k_spin_unlock(&tx_lock, key);
+    k_sem_give(&tx_mailboxes);
+}
+
+void tx_irq_callback(const struct device *dev, int error, void *arg)
+{
     ARG_UNUSED(dev);
 
-    if (error != 0)
+    tx_done((struct tx_entry *)arg, error);
+}
+
+void tx_thread(void *arg1, void *arg2, void *arg3)
+{
+    (void) arg1;
+    (void) arg2;
+    (void) arg3;
+
+    while (1)
     {
-        printf("Callback! error-code: %d\nSender: %s\n",
-               error, sender);
+        k_sem_take(&tx_queued, K_FOREVER);
+        k_sem_take(&tx_mailboxes, K_FOREVER);
+
+        struct tx_entry *slot = NULL;
+        k_spinlock_key_t key = k_spin_lock(&tx_lock);
+        struct tx_entry entry;
+        while (tx_pop(&entry))
+        {
+            if (!tx_expired(&entry))
+            {
+                int index = __builtin_ctz(~tx_in_flight_used);
+                tx_in_flight_used |= BIT(index);
+                slot = &tx_in_flight[index];
+                *slot = entry;
+                break;
+            }
+            // too old to be worth sending, its queued count goes with it
+            tx_stats.expired++;
+            if (k_sem_take(&tx_queued, K_NO_WAIT) != 0)
+            {
+                break;
+            }
+        }
+        k_spin_unlock(&tx_lock, key);
+        if (!slot)
+        {
+            k_sem_give(&tx_mailboxes);
+            continue;
+        }
+
+        struct can_frame frame = {
+            .flags = CAN_FRAME_IDE | (slot->fd ? (CAN_FRAME_FDF | CAN_FRAME_BRS) : 0),
+            .id = slot->id,
+            .dlc = can_bytes_to_dlc(slot->length)}; // an FD length between the DLC steps is padded with zeros
+        memcpy(frame.data, slot->data, slot->length);
+
+        // waits only for a free mailbox, never for the frame to go out
+        int ret = can_send(can_dev, &frame, K_MSEC(100), tx_irq_callback, slot);
+        if (ret != 0)
+        {
+            tx_done(slot, ret);
+            if (ret == -ENETDOWN)
+            {
+                k_sleep(TX_BUS_OFF_BACKOFF); // bus off or stopped, don't spin through the retries
+            }
+        }
     }
 }
 
@@ -60,6 +231,7 @@ void rx_thread(void *arg1, void *arg2, void *arg3)
         }
     };
 
+    // the filters match classic and CAN FD frames alike
     struct can_frame frame;
 
     int filter_id;
@@ -76,7 +248,7 @@ void rx_thread(void *arg1, void *arg2, void *arg3)
         // printk("flags: %d\n", frame.flags);
         int rtr = (frame.flags & CAN_FRAME_RTR);
 
-        rx_callback(frame.id, rtr, frame.data, frame.dlc);
+        rx_callback(frame.id, rtr, frame.data, can_dlc_to_bytes(frame.dlc));
     }
 }
 
@@ -159,7 +331,7 @@ void state_change_callback(const struct device *dev, enum can_state state,
     k_work_submit(work);
 }
 
-k_tid_t rx_tid, get_state_tid;
+k_tid_t rx_tid, get_state_tid, tx_tid;
 
 int CAN_Initialize(CAN_RxCallback rxCallback)
 {
@@ -170,6 +342,19 @@ int CAN_Initialize(CAN_RxCallback rxCallback)
         return CAN_ERROR;
     }
 
+#ifdef CONFIG_CAN_FD_MODE
+    can_mode_t capabilities;
+    if (CAN_FD_TELEMETRY && (can_get_capabilities(can_dev, &capabilities) == 0) && (capabilities & CAN_MODE_FD))
+    {
+        // data phase bitrate from the controller's bitrate-data devicetree property
+        fd_active = (can_set_mode(can_dev, CAN_MODE_FD) == 0);
+    }
+    if (CAN_FD_TELEMETRY && !fd_active)
+    {
+        printk("CAN: %s has no CAN FD, telemetry stays classic\n", can_dev->name);
+    }
+#endif
+
     ret = can_start(can_dev);
     if (ret != 0)
     {
@@ -201,6 +386,16 @@ int CAN_Initialize(CAN_RxCallback rxCallback)
         return CAN_ERROR;
     }
 
+    tx_tid = k_thread_create(&tx_thread_data, tx_thread_stack,
+                             K_THREAD_STACK_SIZEOF(tx_thread_stack),
+                             tx_thread, NULL, NULL, NULL,
+                             TX_THREAD_PRIORITY, 0, K_NO_WAIT);
+    if (!tx_tid)
+    {
+        printk("ERROR spawning tx thread\n");
+        return CAN_ERROR;
+    }
+
     can_set_state_change_callback(can_dev, state_change_callback, &state_change_work);
 
     printk("Finished CAN init.\n");
@@ -209,30 +404,55 @@ int CAN_Initialize(CAN_RxCallback rxCallback)
 }
 
 int CAN_Send(uint32_t id, uint8_t *data, uint8_t dataLen)
+{
+    return CAN_SendPriority(id, data, dataLen, CAN_PRIO_TELEMETRY);
+}
+
+static int tx_queue(uint32_t id, uint8_t *data, uint8_t dataLen, enum CAN_Priority priority, bool fd)
 {
     //printk("CAN_Send to: %x\n", id);
-    struct can_frame frame = {
-        .flags = CAN_FRAME_IDE,
+    if ((dataLen > (fd ? CAN_MAX_DLEN : 8)) || (priority >= CAN_PRIO_COUNT))
+    {
+        return CAN_ERROR;
+    }
+    struct tx_entry entry = {
         .id = id,
-        .dlc = dataLen};
+        .deadline = k_uptime_get_32() + tx_rings[priority].deadlineMs,
+        .length = dataLen,
+        .priority = priority,
+        .fd = fd};
 
-    memcpy(frame.data, data, dataLen);
+    memcpy(entry.data, data, dataLen);
 
-    int retry = 5;
-    int ret = -1;
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    tx_stats.queued++;
+    tx_push(&entry, false);
+    k_spin_unlock(&tx_lock, key);
+    return CAN_SUCCESS;
+}
 
-    while (retry && ret)
-    {
-        ret = can_send(can_dev, &frame, K_MSEC(100), NULL, NULL);
-        if (ret != 0)
-        {
-            printk("can_send failed: %d\n", ret);
-        }
-    }
+int CAN_SendPriority(uint32_t id, uint8_t *data, uint8_t dataLen, enum CAN_Priority priority)
+{
+    return tx_queue(id, data, dataLen, priority, false);
+}
 
-    if (ret != 0)
+int CAN_SendFd(uint32_t id, uint8_t *data, uint8_t dataLen, enum CAN_Priority priority)
+{
+    if (!fd_active)
     {
         return CAN_ERROR;
     }
-    return CAN_SUCCESS;
+    return tx_queue(id, data, dataLen, priority, true);
+}
+
+bool CAN_FdActive(void)
+{
+    return fd_active;
+}
+
+void CAN_GetTxStats(struct CAN_TxStats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    *stats = tx_stats;
+    k_spin_unlock(&tx_lock, key);
 }
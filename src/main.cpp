@@ -1,4 +1,5 @@
 #include <zephyr/kernel.h>
+#include <new>
 
 #include "gpio.h"
 #include "can.h"
@@ -18,8 +19,37 @@ GPIO gpio;
 	ModuleData moduleDatas[1];
 #endif
 
+Slave *localSlave = NULL; // for the capture commands, which arrive from the CAN callback
+
+void protectionChanged(uint8_t moduleId, uint8_t flags)
+{
+	#if MODULE_ID == 0
+	master.setProtection(moduleId, flags);
+	#endif
+}
+
 void messageReceived(uint32_t id, bool rtr, uint8_t *data, uint8_t dataLen)
 {
+	if(id == (BaseAddress + CycleMarkerOffset))
+	{
+		// module 0 starting a telemetry cycle, every module times its slot from it
+		if(localSlave)
+		{
+			localSlave->onCycleMarker(data, dataLen);
+		}
+		return;
+	}
+	if((id & ~(IdMask | DataChannelMask)) == (BaseAddress + CaptureOffset))
+	{
+		// host commands for this module; status and data from the others are for the host
+		auto channel = id & DataChannelMask;
+		if(((id & IdMask) / ModuleOffset) == MODULE_ID && channel <= 1 && localSlave)
+		{
+			localSlave->onCaptureMessage(id, data, dataLen);
+		}
+		return;
+	}
+
 	#if MODULE_ID == 0
 	// printk("Received message %x, rtr: %d, dataLen: %d\n", id, rtr, dataLen);
 
@@ -40,7 +70,12 @@ void messageReceived(uint32_t id, bool rtr, uint8_t *data, uint8_t dataLen)
 			printk("Error: module out of range: %d\n", moduleId);
 			return;
 		}
-		moduleDatas[moduleId].SetRawData(id, data);
+		if((id & DataTypeMask) == ProtectionOffset)
+		{
+			protectionChanged(moduleId, data[0]);
+			return;
+		}
+		moduleDatas[moduleId].SetRawData(id, data, dataLen);
 		if(moduleDatas[moduleId].isComplete())
 		{
 			master.updateModuleData(moduleId, moduleDatas[moduleId]);
@@ -60,7 +95,10 @@ int main(void)
 {
 	
 	CAN_Initialize(messageReceived);
-	Slave slave(moduleDatas[0], MODULE_ID, gpio);
+	// the pack's thread stacks and buffers are far too big for main's stack
+	alignas(Slave) static uint8_t slaveStorage[sizeof(Slave)];
+	Slave &slave = *new (slaveStorage) Slave(moduleDatas[0], MODULE_ID, gpio, protectionChanged);
+	localSlave = &slave;
 
 	while(1)
 	{
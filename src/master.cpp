@@ -76,8 +76,8 @@ MasterBMS::MasterBMS(GPIO &gpio) :
 
     // Calculate dynamic system voltage limits based on NUM_MODULES
     // Ensure calculations don't overflow uint16_t if NUM_MODULES is very large
-    SYSTEM_CHARGE_CUTOFF_VOLTAGE_01V = static_cast<uint16_t>((360UL * 32 * NUM_MODULES) / 10);
-    SYSTEM_DISCHARGE_CUTOFF_VOLTAGE_01V = static_cast<uint16_t>((280UL * 32 * NUM_MODULES) / 10);
+    SYSTEM_CHARGE_CUTOFF_VOLTAGE_01V = static_cast<uint16_t>((360UL * ModuleData::cells * NUM_MODULES) / 10);
+    SYSTEM_DISCHARGE_CUTOFF_VOLTAGE_01V = static_cast<uint16_t>((280UL * ModuleData::cells * NUM_MODULES) / 10);
 
     LOG_INF("MasterBMS initialized for %u modules.", NUM_MODULES);
 }
@@ -101,6 +101,25 @@ bool MasterBMS::updateModuleData(uint8_t moduleIndex, const ModuleData& data)
     return true;
 }
 
+// --- Hardware Protection ---
+
+void MasterBMS::setProtection(uint8_t moduleIndex, uint8_t flags)
+{
+    if (moduleIndex >= NUM_MODULES) {
+        LOG_WRN("Invalid module index %u for protection.", moduleIndex);
+        return;
+    }
+    atomic_set(&protectionFlags_[moduleIndex], flags);
+    // don't wait for the next processData() - the host may ask for 0x4280 any moment
+    if (flags & ProtectionOverVoltage) {
+        outputChargeDischargeStatus_.charge_forbidden = 1;
+    }
+    if (flags & ProtectionUnderVoltage) {
+        outputChargeDischargeStatus_.discharge_forbidden = 1;
+    }
+    LOG_WRN("Module %u hardware protection flags 0x%02x", moduleIndex, flags);
+}
+
 // --- Process Data ---
 
 void MasterBMS::processData() {
@@ -130,11 +149,16 @@ void MasterBMS::processData() {
     uint8_t minModuleVoltageIndex = 0;
     uint8_t maxModuleVoltageIndex = 0;
 
-    uint16_t minModuleTemp_01C = USHRT_MAX;// Non-negative temp
-    uint16_t maxModuleTemp_01C = 0; // Non-negative temp
+    int16_t minModuleTemp_01C = SHRT_MAX;
+    int16_t maxModuleTemp_01C = SHRT_MIN;
     uint8_t minModuleTempIndex = 0;
     uint8_t maxModuleTempIndex = 0;
 
+    int16_t minSensorTemp_01C = SHRT_MAX;
+    int16_t maxSensorTemp_01C = SHRT_MIN;
+    uint16_t minSensorTempIndex = 0;
+    uint16_t maxSensorTempIndex = 0;
+
     int32_t totalCurrent_01mA = 0; // Accumulate current for averaging or checking consistency
 
     // Reset flags (assume OK until proven otherwise)
@@ -145,6 +169,19 @@ void MasterBMS::processData() {
     outputChargeDischargeStatus_.charge_forbidden = 0;
     outputChargeDischargeStatus_.discharge_forbidden = 0;
 
+    // Hardware comparators (fast path, see setProtection) stay in force until the module reports them cleared
+    for (size_t i = 0; i < NUM_MODULES; ++i) {
+        atomic_val_t protection = atomic_get(&protectionFlags_[i]);
+        if (protection & ProtectionOverVoltage) {
+            outputBits_.protection.pov = true;
+            outputChargeDischargeStatus_.charge_forbidden = 1;
+        }
+        if (protection & ProtectionUnderVoltage) {
+            outputBits_.protection.puv = true;
+            outputChargeDischargeStatus_.discharge_forbidden = 1;
+        }
+    }
+
 
     // --- Iterate through modules ---
     for (size_t i = 0; i < NUM_MODULES; ++i) {
@@ -173,27 +210,58 @@ void MasterBMS::processData() {
             maxModuleVoltageIndex = static_cast<uint8_t>((i*2)+1);
         }
 
-        // Module Temperature (Unit: 0.1C, uint16_t)
-        uint16_t currentModuleTemp_01C = modState.temperature;
-        if (currentModuleTemp_01C < minModuleTemp_01C) {
-            minModuleTemp_01C = currentModuleTemp_01C;
+        // Module Temperatures (Unit: 0.1C, int16_t) - hottest and coldest fitted sensor
+        int16_t moduleMaxTemp_01C = SHRT_MIN;
+        int16_t moduleMinTemp_01C = SHRT_MAX;
+        for (size_t j = 0; j < ModuleData::auxes; ++j) {
+            if (!modData.temperatureUpdateFlags.test(j)) {
+                continue;
+            }
+            int16_t sensorTemp_01C = modData.temperatures[j];
+            uint16_t absoluteSensorIndex = static_cast<uint16_t>(i * ModuleData::auxes + j);
+            moduleMaxTemp_01C = MAX(moduleMaxTemp_01C, sensorTemp_01C);
+            moduleMinTemp_01C = MIN(moduleMinTemp_01C, sensorTemp_01C);
+            if (sensorTemp_01C < minSensorTemp_01C) {
+                minSensorTemp_01C = sensorTemp_01C;
+                minSensorTempIndex = absoluteSensorIndex;
+            }
+            if (sensorTemp_01C > maxSensorTemp_01C) {
+                maxSensorTemp_01C = sensorTemp_01C;
+                maxSensorTempIndex = absoluteSensorIndex;
+            }
+        }
+        if (modData.temperatureUpdateFlags.none()) {
+            // module without per-sensor temperatures, all we have is its summary
+            moduleMaxTemp_01C = modState.temperature;
+            moduleMinTemp_01C = modState.temperature;
+            if (moduleMinTemp_01C < minSensorTemp_01C) {
+                minSensorTemp_01C = moduleMinTemp_01C;
+                minSensorTempIndex = static_cast<uint16_t>(i * ModuleData::auxes);
+            }
+            if (moduleMaxTemp_01C > maxSensorTemp_01C) {
+                maxSensorTemp_01C = moduleMaxTemp_01C;
+                maxSensorTempIndex = static_cast<uint16_t>(i * ModuleData::auxes);
+            }
+        }
+        if (moduleMinTemp_01C < minModuleTemp_01C) {
+            minModuleTemp_01C = moduleMinTemp_01C;
             minModuleTempIndex = static_cast<uint8_t>(i);
         }
-        if (currentModuleTemp_01C > maxModuleTemp_01C) {
-            maxModuleTemp_01C = currentModuleTemp_01C;
+        if (moduleMaxTemp_01C > maxModuleTemp_01C) {
+            maxModuleTemp_01C = moduleMaxTemp_01C;
             maxModuleTempIndex = static_cast<uint8_t>(i);
         }
 
-        // Accumulate Current (Unit: 0.1mA, int16_t)
+        // Accumulate Current (ModuleState carries 10mA steps, summed here in 0.1mA)
         // For series strings, current should be similar. Averaging might smooth noise.
         // For parallel strings, need to sum. Assuming series for now, averaging.
-        totalCurrent_01mA += modState.current;
+        totalCurrent_01mA += int32_t(modState.current) * 100;
 
         // Cell Voltages within the module (Unit: 0.1mV)
-        for (size_t j = 0; j < 32; ++j) {
+        for (size_t j = 0; j < ModuleData::cells; ++j) {
             const auto& cellState = modData.cellStates[j];
             uint16_t currentCellVoltage_01mV = cellState.voltage;
-            uint16_t absoluteCellIndex = static_cast<uint16_t>(i * 32 + j);
+            uint16_t absoluteCellIndex = static_cast<uint16_t>(i * ModuleData::cells + j);
 
             if (currentCellVoltage_01mV < minCellVoltage_01mV) {
                 minCellVoltage_01mV = currentCellVoltage_01mV;
@@ -241,28 +309,28 @@ void MasterBMS::processData() {
              outputBits_.alarm.mlv = true;
          }
 
-        // --- Check Module Temperature Alarms/Protections (Unit: 0.1C) ---
-         if (currentModuleTemp_01C > CHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C) {
+        // --- Check Module Temperature Alarms/Protections (Unit: 0.1C) - over on the hottest sensor, under on the coldest ---
+         if (moduleMaxTemp_01C > CHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C) {
              outputBits_.protection.cot = true;
              outputChargeDischargeStatus_.charge_forbidden = 1;
          }
-         if (currentModuleTemp_01C < CHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C) {
+         if (moduleMinTemp_01C < CHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C) {
              outputBits_.protection.cut = true;
               outputChargeDischargeStatus_.charge_forbidden = 1;
          }
-        if (currentModuleTemp_01C > DISCHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C) {
+        if (moduleMaxTemp_01C > DISCHARGE_OVER_TEMP_PROTECTION_THRESHOLD_01C) {
              outputBits_.protection.dot = true;
              outputChargeDischargeStatus_.discharge_forbidden = 1;
          }
-         if (currentModuleTemp_01C < DISCHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C) {
+         if (moduleMinTemp_01C < DISCHARGE_UNDER_TEMP_PROTECTION_THRESHOLD_01C) {
              outputBits_.protection.dut = true;
              outputChargeDischargeStatus_.discharge_forbidden = 1;
          }
          // Alarms
-         if (currentModuleTemp_01C > CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.cht = true;
-         if (currentModuleTemp_01C < CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.clt = true;
-         if (currentModuleTemp_01C > DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.dht = true;
-         if (currentModuleTemp_01C < DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.dlt = true;
+         if (moduleMaxTemp_01C > CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.cht = true;
+         if (moduleMinTemp_01C < CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.clt = true;
+         if (moduleMaxTemp_01C > DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.dht = true;
+         if (moduleMinTemp_01C < DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C) outputBits_.alarm.dlt = true;
 
          // --- Placeholder: Check for other module-specific errors reported by module ---
          // Example: if (modState.some_internal_error_flag) outputBits_.error.other_error = true;
@@ -279,6 +347,8 @@ void MasterBMS::processData() {
     outputStatus_.current = static_cast<uint16_t>((avgCurrent_01mA / 1000) + 30000); // Convert 0.1mA to 0.1A offset -3000A
     // Use max module temp for overall temp (or average)
     outputStatus_.temperature = maxModuleTemp_01C + 1000; // Already in 0.1C units offset -100c
+    maxTemp_01C_ = maxSensorTemp_01C;
+    minTemp_01C_ = minSensorTemp_01C;
     outputStatus_.soc = calculateSOC(minCellVoltage_01mV);
     outputStatus_.soh = calculateSOH();
 
@@ -294,11 +364,11 @@ void MasterBMS::processData() {
     outputCellVoltageStatus_.max_cell_voltage_index = maxCellIndex;
     outputCellVoltageStatus_.min_cell_voltage_index = minCellIndex;
 
-    // Cell Temperature Status (0x4240) - Using Module Temps as discussed
-    outputCellTemperatureStatus_.max_cell_temp = maxModuleTemp_01C + 1000;
-    outputCellTemperatureStatus_.min_cell_temp = minModuleTemp_01C + 1000;
-    outputCellTemperatureStatus_.max_temp_cell_index = maxModuleTempIndex; // Reporting module index
-    outputCellTemperatureStatus_.min_temp_cell_index = minModuleTempIndex; // Reporting module index
+    // Cell Temperature Status (0x4240) - individual sensors, index is module * ModuleData::auxes + device * 8 + aux
+    outputCellTemperatureStatus_.max_cell_temp = maxSensorTemp_01C + 1000;
+    outputCellTemperatureStatus_.min_cell_temp = minSensorTemp_01C + 1000;
+    outputCellTemperatureStatus_.max_temp_cell_index = maxSensorTempIndex;
+    outputCellTemperatureStatus_.min_temp_cell_index = minSensorTempIndex;
 
     // Module Voltage Status (0x4260)
     outputModuleVoltageStatus_.module_max_voltage = maxModuleVoltage_01V * 100; // Already in 0.1V
@@ -373,49 +443,49 @@ void MasterBMS::handleHostRequest(Request request) {
                     return;
                 }
                 // Send Status (0x4210)
-                CAN_Send(CAN_ID_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputStatus_),
-                         sizeof(Message::Status));
+                CAN_SendPriority(CAN_ID_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputStatus_),
+                                 sizeof(Message::Status), CAN_PRIO_CONTROL);
 
                 // Send Charge/Discharge Parameters (0x4220)
-                CAN_Send(CAN_ID_CHARGE_DISCHARGE_PARAMS,
-                         reinterpret_cast<uint8_t*>(&outputChargeDischargeParams_),
-                         sizeof(Message::ChargeDischargeParameters));
+                CAN_SendPriority(CAN_ID_CHARGE_DISCHARGE_PARAMS,
+                                 reinterpret_cast<uint8_t*>(&outputChargeDischargeParams_),
+                                 sizeof(Message::ChargeDischargeParameters), CAN_PRIO_CONTROL);
 
                 // Send Cell Voltage Status (0x4230)
-                CAN_Send(CAN_ID_CELL_VOLTAGE_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputCellVoltageStatus_),
-                         sizeof(Message::CellVoltageStatus));
+                CAN_SendPriority(CAN_ID_CELL_VOLTAGE_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputCellVoltageStatus_),
+                                 sizeof(Message::CellVoltageStatus), CAN_PRIO_CONTROL);
 
                 // Send Cell Temperature Status (0x4240)
-                CAN_Send(CAN_ID_CELL_TEMPERATURE_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputCellTemperatureStatus_),
-                         sizeof(Message::CellTemperatureStatus));
+                CAN_SendPriority(CAN_ID_CELL_TEMPERATURE_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputCellTemperatureStatus_),
+                                 sizeof(Message::CellTemperatureStatus), CAN_PRIO_CONTROL);
 
                 // Send Bits (Status, Error, Alarm, Protection) (0x4250)
-                CAN_Send(CAN_ID_BITS,
-                         reinterpret_cast<uint8_t*>(&outputBits_),
-                         sizeof(Message::Bits));
+                CAN_SendPriority(CAN_ID_BITS,
+                                 reinterpret_cast<uint8_t*>(&outputBits_),
+                                 sizeof(Message::Bits), CAN_PRIO_CONTROL);
 
                 // Send Module Voltage Status (0x4260)
-                CAN_Send(CAN_ID_MODULE_VOLTAGE_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputModuleVoltageStatus_),
-                         sizeof(Message::ModuleVoltageStatus));
+                CAN_SendPriority(CAN_ID_MODULE_VOLTAGE_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputModuleVoltageStatus_),
+                                 sizeof(Message::ModuleVoltageStatus), CAN_PRIO_CONTROL);
 
                 // Send Module Temperature Status (0x4270)
-                CAN_Send(CAN_ID_MODULE_TEMPERATURE_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputModuleTemperatureStatus_),
-                         sizeof(Message::ModuleTemperatureStatus));
+                CAN_SendPriority(CAN_ID_MODULE_TEMPERATURE_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputModuleTemperatureStatus_),
+                                 sizeof(Message::ModuleTemperatureStatus), CAN_PRIO_CONTROL);
 
                 // Send Charge/Discharge Status (0x4280)
-                CAN_Send(CAN_ID_CHARGE_DISCHARGE_STATUS,
-                         reinterpret_cast<uint8_t*>(&outputChargeDischargeStatus_),
-                         sizeof(Message::ChargeDischargeStatus));
+                CAN_SendPriority(CAN_ID_CHARGE_DISCHARGE_STATUS,
+                                 reinterpret_cast<uint8_t*>(&outputChargeDischargeStatus_),
+                                 sizeof(Message::ChargeDischargeStatus), CAN_PRIO_CONTROL);
 
                 // Send Fault Extension Info (0x4290)
-                CAN_Send(CAN_ID_FAULT_EXTENSION_INFO,
-                         reinterpret_cast<uint8_t*>(&outputFaultExt_),
-                         sizeof(Message::FaultExtensionInfo));
+                CAN_SendPriority(CAN_ID_FAULT_EXTENSION_INFO,
+                                 reinterpret_cast<uint8_t*>(&outputFaultExt_),
+                                 sizeof(Message::FaultExtensionInfo), CAN_PRIO_CONTROL);
 
                 LOG_INF("Finished sending Ensemble Information.");
             }
@@ -532,9 +602,9 @@ uint16_t MasterBMS::calculateMaxChargeCurrent() {
     uint16_t base_max_charge_01A = abs(CHARGE_OVER_CURRENT_ALARM_THRESHOLD_01A);
     float min_derating_factor = 1.0f;
 
-    // 1. Temperature Derating (based on existing alarm thresholds)
-    if (outputStatus_.temperature < CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C ||
-        outputStatus_.temperature > CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) {
+    // 1. Temperature Derating (based on existing alarm thresholds, coldest and hottest sensor)
+    if (minTemp_01C_ < CHARGE_LOW_TEMP_ALARM_THRESHOLD_01C ||
+        maxTemp_01C_ > CHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) {
         // LOG_WRN(...); // Logging moved out or made conditional to reduce spam
         min_derating_factor = fminf(min_derating_factor, TEMP_DERATE_FACTOR);
     }
@@ -590,9 +660,9 @@ uint16_t MasterBMS::calculateMaxDischargeCurrent() {
     uint16_t base_max_discharge_01A = abs(DISCHARGE_OVER_CURRENT_ALARM_THRESHOLD_01A);
     float min_derating_factor = 1.0f;
 
-    // 1. Temperature Derating (based on existing alarm thresholds)
-    if (outputStatus_.temperature < DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C ||
-        outputStatus_.temperature > DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) {
+    // 1. Temperature Derating (based on existing alarm thresholds, coldest and hottest sensor)
+    if (minTemp_01C_ < DISCHARGE_LOW_TEMP_ALARM_THRESHOLD_01C ||
+        maxTemp_01C_ > DISCHARGE_HIGH_TEMP_ALARM_THRESHOLD_01C) {
         // LOG_WRN(...); // Logging moved out or made conditional
         min_derating_factor = fminf(min_derating_factor, TEMP_DERATE_FACTOR);
     }
@@ -1,41 +1,197 @@
 #include "module_data.h"
 #include <zephyr/kernel.h>
+#include <string.h>
 
-void ModuleData::SetRawData(uint32_t address, uint8_t *data)
+template <uint8_t Devices>
+void ModuleDataT<Devices>::SetRawData(uint32_t address, uint8_t *data, uint8_t dataLen)
 {
     if(isComplete())
     {
-        cellStatesUpdateFlags = 0;
-        adcUpdateFlags = 0;
+        if(!deltaMode)
+        {
+            cellStatesUpdateFlags.clear();
+            adcUpdateFlags.clear();
+            temperatureUpdateFlags.clear();
+        }
         moduleStateFlag = false;
     }
 
+    uint32_t now = k_uptime_get_32();
     if((address & DataTypeMask) == ModuleStateOffset)
     {
         moduleState = *reinterpret_cast<ModuleState *>(data);
         moduleStateFlag = true;
+        deltaMode = (address & DataChannelMask) == 1;
     }
     else if((address & DataTypeMask) == CellStateOffset)
     {
         uint32_t channel = address & DataChannelMask;
-        if(channel < 32)
+        if(channel < cells)
         {
             cellStates[channel] = *reinterpret_cast<CellState *>(data);
-            cellStatesUpdateFlags |= (1 << channel);
+            cellStatesUpdateFlags.set(channel);
+            cellUpdatedMs[channel] = now;
         }
     }
     else if((address & DataTypeMask) == AdcVoltageOffset)
     {
         uint32_t channel = address & DataChannelMask;
-        if(channel < 16)
+        if(channel < auxes)
         {
             adcStates[channel] = *reinterpret_cast<uint16_t *>(data);
-            adcUpdateFlags |= (1 << channel);
+            adcUpdateFlags.set(channel);
+        }
+    }
+    else if((address & DataTypeMask) == TemperatureOffset)
+    {
+        uint32_t channel = address & DataChannelMask;
+        if(channel < auxes)
+        {
+            temperatures[channel] = *reinterpret_cast<int16_t *>(data);
+            temperatureUpdateFlags.set(channel);
+        }
+    }
+    else if((address & DataTypeMask) == PackedCellOffset)
+    {
+        uint32_t first = (address & DataChannelMask) * 4;
+        PackedValues values;
+        memcpy(&values, data, sizeof(values));
+        for(uint32_t i = 0; (i < 4) && (first + i < cells); i++)
+        {
+            cellStates[first + i].voltage = values.values[i];
+            cellStatesUpdateFlags.set(first + i);
+            cellUpdatedMs[first + i] = now;
+        }
+    }
+    else if((address & DataTypeMask) == BalanceOffset)
+    {
+        // goes out ahead of the cells, it only fills in their balancing flags
+        uint32_t first = (address & DataChannelMask) * 32;
+        BalanceBitmap bitmap;
+        memcpy(&bitmap, data, sizeof(bitmap));
+        for(uint32_t i = 0; (i < 32) && (first + i < cells); i++)
+        {
+            cellStates[first + i].balancing = (bitmap.cells >> i) & 1;
         }
     }
+    else if((address & DataTypeMask) == PackedAdcOffset)
+    {
+        uint32_t first = (address & DataChannelMask) * 4;
+        PackedValues values;
+        memcpy(&values, data, sizeof(values));
+        for(uint32_t i = 0; (i < 4) && (first + i < auxes); i++)
+        {
+            adcStates[first + i] = values.values[i];
+            adcUpdateFlags.set(first + i);
+        }
+    }
+    else if((address & DataTypeMask) == PackedTemperatureOffset)
+    {
+        uint32_t first = (address & DataChannelMask) * 4;
+        PackedValues values;
+        memcpy(&values, data, sizeof(values));
+        for(uint32_t i = 0; (i < 4) && (first + i < auxes); i++)
+        {
+            if(int16_t(values.values[i]) != TemperatureNotFitted)
+            {
+                temperatures[first + i] = int16_t(values.values[i]);
+                temperatureUpdateFlags.set(first + i);
+            }
+        }
+    }
+    else if((address & DataTypeMask) == FdSnapshotOffset)
+    {
+        // only complete once every segment is in, then it counts like the whole set of classic frames
+        uint32_t segment = address & DataChannelMask;
+        if(segment < fdSegments)
+        {
+            uint32_t start = segment * FdSegmentBytes;
+            memcpy(reinterpret_cast<uint8_t *>(&fdStaging) + start, data, MIN(uint32_t(dataLen), sizeof(FdSnapshot) - start));
+            fdSegmentsReceived |= 1u << segment;
+            if(fdSegmentsReceived == (1u << fdSegments) - 1)
+            {
+                applyFdSnapshot();
+                fdSegmentsReceived = 0;
+            }
+        }
+    }
+    else if((address & DataTypeMask) == CurrentOffset)
+    {
+        uint32_t channel = address & DataChannelMask;
+        if(channel == 0)
+        {
+            currentState = *reinterpret_cast<CurrentState *>(data);
+        }
+        else if(channel == 1)
+        {
+            chargeState = *reinterpret_cast<ChargeState *>(data);
+        }
+    }
+}
+
+template <uint8_t Devices>
+void ModuleDataT<Devices>::fillFdSnapshot(FdSnapshot &snapshot) const
+{
+    snapshot.moduleState = moduleState;
+    for(uint16_t word = 0; word < ARRAY_SIZE(snapshot.balancing); word++)
+    {
+        uint32_t bits = 0;
+        for(uint16_t i = 0; (i < 32) && (word * 32 + i < cells); i++)
+        {
+            bits |= uint32_t(cellStates[word * 32 + i].balancing ? 1 : 0) << i;
+        }
+        snapshot.balancing[word] = bits;
+    }
+    for(uint16_t i = 0; i < cells; i++)
+    {
+        snapshot.cellVoltages[i] = cellStates[i].voltage;
+    }
+    for(uint16_t i = 0; i < auxes; i++)
+    {
+        snapshot.adcStates[i] = adcStates[i];
+    }
+}
+
+template <uint8_t Devices>
+void ModuleDataT<Devices>::applyFdSnapshot()
+{
+    moduleState = fdStaging.moduleState;
+    moduleStateFlag = true;
+    for(uint16_t i = 0; i < cells; i++)
+    {
+        cellStates[i].voltage = fdStaging.cellVoltages[i];
+        cellStates[i].balancing = (fdStaging.balancing[i / 32] >> (i % 32)) & 1;
+        cellStatesUpdateFlags.set(i);
+        cellUpdatedMs[i] = k_uptime_get_32();
+    }
+    for(uint16_t i = 0; i < auxes; i++)
+    {
+        adcStates[i] = fdStaging.adcStates[i];
+        adcUpdateFlags.set(i);
+    }
 }
 
-bool ModuleData::isComplete()
+template <uint8_t Devices>
+bool ModuleDataT<Devices>::isComplete()
 {
-    return moduleStateFlag && (cellStatesUpdateFlags == 0xFFFFFFFF) && (adcUpdateFlags == 0xFFFF);
-}
\ No newline at end of file
+    // a delta round ends with the module state; what didn't come is unchanged, unless it is too old to trust
+    return moduleStateFlag && cellStatesUpdateFlags.all() && adcUpdateFlags.all() &&
+           (!deltaMode || (staleCells(TELEMETRY_STALE_MS) == 0));
+}
+
+template <uint8_t Devices>
+uint16_t ModuleDataT<Devices>::staleCells(uint32_t maxAgeMs) const
+{
+    uint32_t now = k_uptime_get_32();
+    uint16_t stale = 0;
+    for(uint16_t i = 0; i < cells; i++)
+    {
+        if(!cellStatesUpdateFlags.test(i) || (now - cellUpdatedMs[i] > maxAgeMs))
+        {
+            stale++;
+        }
+    }
+    return stale;
+}
+
+template struct ModuleDataT<MODULE_DEVICES>;
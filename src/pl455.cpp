@@ -1,70 +1,34 @@
 #include "pl455.h"
+#include "pl455_crc.h"
+#include "pl455_topology.h"
+#include "pl455_ntc.h"
 #include <math.h>
+#include <stdlib.h>
 
-#define BQUART_NODE DT_ALIAS(bquart)
-#if !DT_NODE_HAS_STATUS_OKAY(BQUART_NODE)
-#error "BOARD does not define bquart"
-#endif
+LOG_MODULE_REGISTER(pl455, CONFIG_PL455_LOG_LEVEL);
 
-#define BQWAKEUP_NODE DT_ALIAS(bqwakeup)
-#if !DT_NODE_HAS_STATUS_OKAY(BQWAKEUP_NODE)
-#error "BOARD does not define bqwakeup"
-#endif
+PL455::PL455(GPIO& gpio, uint8_t chain, const struct device *uart, const struct gpio_dt_spec &wakeup,
+             const struct gpio_dt_spec *fault, PL455Device *devices, uint8_t maxDevices)
+    : mGPIO(gpio), mChain(chain), mUart(uart), mLink(mUart), devices(devices), maxDevices(maxDevices)
+{
+    k_mutex_init(&dataLock);
 
-LOG_MODULE_REGISTER(pl455, CONFIG_PL455_LOG_LEVEL);
+    static const char *const queueNames[] = {"pl455_bms0", "pl455_bms1", "pl455_bms2"};
+    const struct k_work_queue_config config = {.name = queueNames[MIN(chain, ARRAY_SIZE(queueNames) - 1)]};
+    k_work_queue_init(&mQueue);
+    k_work_queue_start(&mQueue, queueStack, K_KERNEL_STACK_SIZEOF(queueStack), PL455_BMS_PRIORITY, &config);
 
-uint32_t micros()
-{
-    /* k_cycle_get_32() returns the current hardware cycle count,
-       and k_cyc_to_ns_floor32() converts cycles to nanoseconds.
-       Dividing by 1000 converts nanoseconds to microseconds. */
-    return k_cyc_to_ns_floor32(k_cycle_get_32()) / 1000;
-}
-
-static const uint16_t crc16_table[256] = { // CRC16 for PL455 - ITU_T polynomial: x^16 + x^15 + x^2 + 1
-    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
-    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
-    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
-    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
-    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
-    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
-    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
-    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
-    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
-    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
-    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
-    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
-    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
-    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
-    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
-    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
-    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
-    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
-    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
-    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
-    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
-    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
-    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
-    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
-    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
-    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
-    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
-    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
-    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
-    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
-    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
-    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040};
-
-PL455::PL455(GPIO& gpio) : mGPIO(gpio)
-{
-    uartDev = DEVICE_DT_GET(BQUART_NODE);
-    if (!uartDev)
-    {
-        LOG_ERR("Error: UART device not found.\n");
-        return;
+    faultWork.owner = this;
+    faultReportWork.owner = this;
+    faultIsr.owner = this;
+    k_work_init(&faultWork.work, onFaultChanged);
+    k_work_init(&faultReportWork.work, onFaultRead);
+    if (fault)
+    {
+        faultGPIO = *fault;
     }
 
-    wakeupGPIO = GPIO_DT_SPEC_GET(BQWAKEUP_NODE, gpios);
+    wakeupGPIO = wakeup;
 
     if (!device_is_ready(wakeupGPIO.port))
     {
@@ -74,7 +38,12 @@ PL455::PL455(GPIO& gpio) : mGPIO(gpio)
 
     gpio_pin_configure_dt(&wakeupGPIO, GPIO_OUTPUT_INACTIVE);
 
-    init();
+#if PL455_CRC_BENCHMARK
+    CRC16Benchmark();
+#endif
+#if PL455_NTC_BENCHMARK
+    NTCBenchmark();
+#endif
 }
 
 /**
@@ -102,39 +71,88 @@ int PL455::wakeup()
 }
 
 // PL455 register settings, stored here as LSuint8_t first
-const uint8_t REG03[4] = {0b00000010, 0b11111111, 0b11111111, 0b11111111}; // sample all cells, all aux, and vmodule
-const uint8_t REG07[1] = {0b01111011};                                     // sample multiple times on same channel, 12.6us sampling, 8x oversample (recommended by TI)
-const uint8_t REG0C[1] = {0b00001000};                                     // start autoaddressing
-const uint8_t REG0D[1] = {16};                                             // 16 battery cells
-const uint8_t REG0E[1] = {0b00011001};                                     // internal reg enabled, addresses set by autoaddressing, comparators disabled, hysteresis disabled, faults unlatched
-const uint8_t REG0F[1] = {0b10000000};                                     // AFE_PCTL enabled (recommended by TI)
-const uint8_t REG13[1] = {0b10001000};                                     // balance continues up to 1 second following balancing enable, balancing continues through fault
-const uint8_t REG1E[2] = {0b00000001, 0b00000000};                         // enable module voltage readings
-const uint8_t REG28[1] = {0x55};                                           // shutdown module 5 seconds after last comm
-const uint8_t REG32[1] = {0b00000000};                                     // automonitor off
-const uint8_t REG3E[1] = {0xCD};                                           // ADC sample period (60usec  - 0xBB, recommended by TI, but BMW set 0xCD);
-const uint8_t REG3F[4] = {0x44, 0x44, 0x44, 0x44};                         // AUX ADC sample period 12.6usec (recommended by TI);
-
-void PL455::commReset(bool reset)
-{ 
-    // performs comms break or reset
-    // pinMode(1, OUTPUT);
-    // if (reset == 0)
-    // { // comms break
-    //     // hold TX low for 12 bit periods
-    //     unsigned long lowTime = 12000000 / setBaud;
-    //     digitalWrite(1, LOW);
-    //     delayMicroseconds(lowTime);
-    //     digitalWrite(1, HIGH);
-    // }
-    // else
-    // { // comms reset
-    //     // hold TX low for at least 200usec
-    //     digitalWrite(1, LOW);
-    //     delayMicroseconds(300);
-    //     digitalWrite(1, HIGH);
-    // }
-}
+constexpr uint8_t REG03[4] = {0b00000010, 0b11111111, 0b11111111, 0b11111111}; // sample all cells, all aux, and vmodule
+constexpr uint8_t REG03_CURRENT[4] = {0b00000000, 0b10000000, 0b00000000, 0b00000000}; // sample aux 7 (current shunt) only
+constexpr uint8_t REG07[1] = {0b01111011};                                     // sample multiple times on same channel, 12.6us sampling, 8x oversample (recommended by TI)
+constexpr uint8_t REG07_FAST[1] = {0b01111001};                                // the same with 2x oversample
+constexpr uint8_t REG07_LOW_NOISE[1] = {0b01111100};                           // the same with 16x oversample
+constexpr uint8_t REG0C[1] = {0b00001000};                                     // start autoaddressing
+constexpr uint8_t REG0D[1] = {16};                                             // 16 battery cells
+#if PL455_CMP_ENABLE
+constexpr uint8_t REG0E[1] = {0b00011011};                                     // internal reg enabled, addresses set by autoaddressing, comparators enabled, hysteresis disabled, faults unlatched
+#else
+constexpr uint8_t REG0E[1] = {0b00011001};                                     // internal reg enabled, addresses set by autoaddressing, comparators disabled, hysteresis disabled, faults unlatched
+#endif
+constexpr uint8_t REG0F[1] = {0b10000000};                                     // AFE_PCTL enabled (recommended by TI)
+constexpr uint8_t REG13[1] = {0b10001000};                                     // balance continues up to 1 second following balancing enable, balancing continues through fault
+constexpr uint32_t REG13_BALANCE_TIME_US = 1000000;
+constexpr uint8_t REG1E[2] = {0b00000001, 0b00000000};                         // enable module voltage readings
+constexpr uint8_t REG28[1] = {0x55};                                           // shutdown module 5 seconds after last comm
+#if PL455_AUTOMONITOR
+constexpr uint8_t REG32[1] = {PL455_AM_PER};                                   // automonitor period
+#else
+constexpr uint8_t REG32[1] = {0b00000000};                                     // automonitor off
+#endif
+constexpr uint8_t REG33[4] = {0b00000010, 0b11111111, 0b11111111, 0b11111111}; // automonitor all cells, all aux, and vmodule, the same as REG03
+constexpr uint8_t REG3E[1] = {0xCD};                                           // ADC sample period (60usec  - 0xBB, recommended by TI, but BMW set 0xCD);
+constexpr uint8_t REG3F[4] = {0x44, 0x44, 0x44, 0x44};                         // AUX ADC sample period 12.6usec (recommended by TI);
+constexpr uint8_t REG10[2] = {0b11100000, 1 << 4};                         // enable all comms apart from fault, UART baud setting 1 (250000)
+constexpr uint8_t REG6E[2] = {0b00000000, 0b00001100};                     // FAULT_N output on comparator under/over voltage only
+constexpr uint8_t REG8C[1] = {(PL455_CMP_UV_MV - 700) / 25};               // comparator under voltage, 0.7V + 25mV steps
+constexpr uint8_t REG8D[1] = {(PL455_CMP_OV_MV - 2000) / 25};              // comparator over voltage, 2V + 25mV steps
+static_assert(PL455_CMP_UV_MV >= 700 && (PL455_CMP_UV_MV - 700) / 25 < 136, "PL455_CMP_UV_MV out of range");
+static_assert(PL455_CMP_OV_MV >= 2000 && (PL455_CMP_OV_MV - 2000) / 25 < 128, "PL455_CMP_OV_MV out of range");
+
+// command register (0x02) data: bit 5 sends the results of the last conversion without starting one
+constexpr uint8_t CMD_SEND_LAST = 0b00100000;
+// response to a full scan: init byte, 16 cells, 8 aux, module voltage (all 16bit), 2 CRC bytes
+constexpr uint8_t VOLTAGES_RESPONSE_SIZE = (NUM_CELLS + 8 + 1) * 2 + 3;
+
+// fault summary (0x52) bits, the same layout as FO_CTRL (0x6E)
+constexpr uint16_t FAULT_SUM_CMPUV = 1 << 11;
+constexpr uint16_t FAULT_SUM_CMPOV = 1 << 10;
+
+// per device comms (0x10) bits for passing faults down the chain to the FAULT line
+constexpr uint8_t COMM_FAULT_HIGH = PL455_CMP_ENABLE ? 0b00010000 : 0;
+constexpr uint8_t COMM_FAULT_LOW = PL455_CMP_ENABLE ? 0b00001000 : 0;
+constexpr uint8_t REG14_OFF[2] = {0, 0};                                   // all balance switches off
+
+// the same settings as complete broadcast frames, CRC included, built at compile time
+constexpr auto REG03_FRAME = PL455BroadcastWrite(0x03, REG03);
+constexpr auto REG07_FRAME = PL455BroadcastWrite(0x07, REG07);
+constexpr auto REG07_FAST_FRAME = PL455BroadcastWrite(0x07, REG07_FAST);
+constexpr auto REG07_LOW_NOISE_FRAME = PL455BroadcastWrite(0x07, REG07_LOW_NOISE);
+constexpr auto REG0C_FRAME = PL455BroadcastWrite(0x0C, REG0C);
+constexpr auto REG0D_FRAME = PL455BroadcastWrite(0x0D, REG0D);
+constexpr auto REG0E_FRAME = PL455BroadcastWrite(0x0E, REG0E);
+constexpr auto REG0F_FRAME = PL455BroadcastWrite(0x0F, REG0F);
+constexpr auto REG10_FRAME = PL455BroadcastWrite(0x10, REG10);
+constexpr auto REG13_FRAME = PL455BroadcastWrite(0x13, REG13);
+constexpr auto REG14_OFF_FRAME = PL455BroadcastWrite(0x14, REG14_OFF);
+constexpr auto REG1E_FRAME = PL455BroadcastWrite(0x1E, REG1E);
+constexpr auto REG28_FRAME = PL455BroadcastWrite(0x28, REG28);
+constexpr auto REG32_FRAME = PL455BroadcastWrite(0x32, REG32);
+constexpr auto REG33_FRAME = PL455BroadcastWrite(0x33, REG33);
+constexpr auto REG3E_FRAME = PL455BroadcastWrite(0x3E, REG3E);
+constexpr auto REG3F_FRAME = PL455BroadcastWrite(0x3F, REG3F);
+constexpr auto REG6E_FRAME = PL455BroadcastWrite(0x6E, REG6E);
+constexpr auto REG8C_FRAME = PL455BroadcastWrite(0x8C, REG8C);
+constexpr auto REG8D_FRAME = PL455BroadcastWrite(0x8D, REG8D);
+
+// indexed by PL455Oversampling
+constexpr const uint8_t *REG07_PROFILES[] = {REG07_FAST_FRAME.bytes, REG07_FRAME.bytes, REG07_LOW_NOISE_FRAME.bytes};
+static_assert(PL455_OVERSAMPLING < ARRAY_SIZE(REG07_PROFILES), "PL455_OVERSAMPLING out of range");
+static_assert(BALANCE_HYSTERESIS < BALANCE_TOLERANCE, "BALANCE_HYSTERESIS would let a cell below the min cell balance");
+
+// balancing is refreshed at least every half timer period, i.e. well before the devices switch it off
+static_assert(BMS_CYCLE_PERIOD_MAX / (100 / (100 - BALANCE_DUTYCYCLE)) < REG13_BALANCE_TIME_US / 2, "balance timer would expire before the next refresh");
+static_assert(!PL455_AUTOMONITOR || PL455_AM_PERIOD_US < BMS_CYCLE_PERIOD_MIN / (100 / (100 - BALANCE_DUTYCYCLE)),
+              "auto-monitor has to convert at least once per step");
+static_assert(BMS_CYCLE_PERIOD_MIN <= BMS_CYCLE_PERIOD && BMS_CYCLE_PERIOD <= BMS_CYCLE_PERIOD_MAX, "BMS_CYCLE_PERIOD outside of its limits");
+
+// broadcast without response, 2 data bytes, then the register address
+static_assert(REG10_FRAME.bytes[0] == 0xF2 && REG10_FRAME.bytes[1] == 0x10, "broadcast write header");
+
 
 void PL455::findMinMaxCellVolt()
 { 
@@ -145,7 +163,7 @@ void PL455::findMinMaxCellVolt()
     {
         for (uint8_t cell = 0; cell < NUM_CELLS; cell++)
         {
-            uint16_t cellVolt = cellVoltages[module][cell];
+            uint16_t cellVolt = devices[module].cellFast[cell];
             if (cellVolt > CELL_IGNORE_VOLT)
             { 
                 // only process connected cells
@@ -168,28 +186,83 @@ void PL455::findMinMaxCellVolt()
 
 void PL455::chooseBalanceCells()
 { 
-    // works out which cells need balancing
+    // works out which cells need balancing, one mask word per device, on the slow filtered voltages
+    // replace 1==1 with a 'charging' variable
+    bool anyVoltage = (BALANCE_WHILE_CHARGE == 1) && (1 == 1);
+    uint16_t minSlow = 65535;
     for (int module = 0; module < numModules; module++)
     {
         for (int cell = 0; cell < NUM_CELLS; cell++)
         {
-            if ((cellVoltages[module][cell] > minCellVoltage + BALANCE_TOLERANCE) && ((cellVoltages[module][cell] > BALANCE_MIN_VOLT) || ((BALANCE_WHILE_CHARGE == 1) && (1 == 1))))
-            { 
-                // replace 1==1 with a 'charging' variable
-                balanceCells[module][cell] = 1;
+            uint16_t cellVolt = devices[module].cellSlow[cell] >> 8;
+            if ((cellVolt > CELL_IGNORE_VOLT) && (cellVolt < minSlow))
+            {
+                minSlow = cellVolt;
+            }
+        }
+    }
+    // a cell starts balancing above the tolerance and keeps going until it is within tolerance - hysteresis,
+    // so a cell sitting right on the threshold doesn't toggle its FET (and cost a write) every cycle
+    uint32_t threshold = minSlow + BALANCE_TOLERANCE;
+    uint32_t holdThreshold = minSlow + BALANCE_TOLERANCE - BALANCE_HYSTERESIS;
+    for (int module = 0; module < numModules; module++)
+    {
+        uint16_t mask = 0;
+        for (int cell = 0; cell < NUM_CELLS; cell++)
+        {
+            uint16_t cellVolt = devices[module].cellSlow[cell] >> 8;
+            bool balancing = (devices[module].balanceMask >> cell) & 1;
+            mask |= uint16_t((cellVolt > (balancing ? holdThreshold : threshold)) && ((cellVolt > BALANCE_MIN_VOLT) || anyVoltage)) << cell;
+        }
+        devices[module].balanceMask = mask;
+    }
+}
+
+void PL455::filterCells()
+{
+    // called with dataLock held once per complete measurement. The fast output rejects single
+    // readings that are way off, the slow one averages the noise out for balancing.
+    for (int module = 0; module < numModules; module++)
+    {
+        for (int cell = 0; cell < NUM_CELLS; cell++)
+        {
+            uint16_t reading = devices[module].cellVoltages[cell];
+            uint16_t *history = devices[module].cellHistory[cell];
+            if (!filterPrimed)
+            {
+                history[0] = reading;
+                history[1] = reading;
+                devices[module].cellSlow[cell] = uint32_t(reading) << 8;
+            }
+
+            uint16_t fast = reading;
+            if (CELL_FILTER_MEDIAN)
+            {
+                uint16_t a = history[0], b = history[1];
+                fast = MAX(MIN(a, b), MIN(MAX(a, b), reading));
+            }
+            history[0] = history[1];
+            history[1] = reading;
+            devices[module].cellFast[cell] = fast;
+
+            if (CELL_FILTER_SLOW_SHIFT)
+            {
+                int32_t slow = devices[module].cellSlow[cell];
+                devices[module].cellSlow[cell] = slow + (((int32_t(fast) << 8) - slow) >> CELL_FILTER_SLOW_SHIFT);
             }
             else
             {
-                balanceCells[module][cell] = 0;
+                devices[module].cellSlow[cell] = uint32_t(fast) << 8;
             }
         }
     }
+    filterPrimed = true;
 }
 
 bool PL455::getBalanceStatus(uint8_t module, uint8_t cell)
 { 
     // returns 1 if the cell is balancing
-    return balanceCells[module][cell];
+    return (devices[module].balanceMask >> cell) & 1;
 }
 
 uint16_t PL455::adc2volt(uint16_t adcReading)
@@ -199,28 +272,21 @@ uint16_t PL455::adc2volt(uint16_t adcReading)
     return uint16_t(voltage);
 }
 
-float PL455::adc2temp(uint16_t adcReading)
+int16_t PL455::adc2temp(uint16_t adcReading)
 { 
-    // converts ADC readings into temperature, degC
-    const float To = 290;
-    const float Ro = 100000;
-    const float Rfix = 150000;
-    const float B = 3950;
-    float R = (adcReading * Rfix) / (65535 - adcReading);
-    float invTemp = (1 / To) + (1 / B) * logf(R / Ro);
-    float temperature = (1 / invTemp) - 273;
-    return temperature;
+    // converts ADC readings into temperature, 10ths of a degC
+    return NTCTemperature(adcReading);
 }
 
-float PL455::getTemperature(uint8_t module, uint8_t sensor)
+int16_t PL455::getTemperature(uint8_t module, uint8_t sensor)
 {
-    return adc2temp(auxVoltages[module][sensor]);
+    return adc2temp(devices[module].auxVoltages[sensor]);
 }
 
 uint16_t PL455::getModuleVoltage(uint8_t module)
 { 
     // provides the overall voltage of the chosen module, in hundredths of a volt
-    uint16_t moduleADC = moduleVoltages[module];
+    uint16_t moduleADC = devices[module].moduleVoltage;
     uint32_t moduleVolts = (uint32_t(12500) * uint32_t(moduleADC)) / uint32_t(65535);
     return uint16_t(moduleVolts);
 }
@@ -228,13 +294,13 @@ uint16_t PL455::getModuleVoltage(uint8_t module)
 uint16_t PL455::getCellVoltage(uint8_t module, uint8_t cell)
 { 
     // provides cell voltage, in 10ths of a millivolt
-    return adc2volt(cellVoltages[module][cell]);
+    return adc2volt(devices[module].cellFast[cell]);
 }
 
 uint16_t PL455::getAuxVoltage(uint8_t module, uint8_t aux)
 { 
     // provides aux input voltage, in 10ths of a millivolt
-    return adc2volt(auxVoltages[module][aux]);
+    return adc2volt(devices[module].auxVoltages[aux]);
 }
 
 uint16_t PL455::getMaxCellVoltage()
@@ -252,176 +318,83 @@ uint16_t PL455::getDifCellVoltage()
     return adc2volt(difCellVoltage);
 }
 
-uint8_t PL455::getInitFrame(uint8_t _readWrite, uint8_t scope, uint8_t data_size)
-{
-    uint8_t initFrame = 0;          // variables for the initialization frame
-    uint8_t _data_size = 0;         // bits 2 - 0
-    uint8_t _addr_size = ADDR_SIZE; // bit 3. 0 is 8bit address size (recommended by TI), 1 is 16bit (used by BMW)
-    uint8_t _req_type = 0;          // bits 6 - 4
-    uint8_t _frm_type = 1;          // bit 7. Will always be 1 here (0 is a response back from the PL455s)
-
-    switch (data_size)
-    {
-    case 0:
-        _data_size = 0;
-        break;
-    case 1:
-        _data_size = 1;
-        break;
-    case 2:
-        _data_size = 2;
-        break;
-    case 3:
-        _data_size = 3;
-        break;
-    case 4:
-        _data_size = 4;
-        break;
-    case 5:
-        _data_size = 5;
-        break;
-    case 6:
-        _data_size = 6;
-        break;
-    case 8:
-        _data_size = 7;
-        break;
-    case 7:
-    default: // doesn't accept 7 uint8_ts, or more than 8 uint8_ts of data
-        LOG_ERR("ERROR: cannot write with %d bytes!\n", data_size);
-        break;
-    }
-
-    switch (scope)
-    {
-    case 0:
-    case 1:
-    case 3:
-        _req_type = _readWrite | (scope << 1);
-        break;
-    default:
-        LOG_ERR("ERROR: Bad init frame scope: %d!\n", scope);
-        break;
-    }
-
-    initFrame = _data_size | (_addr_size << 3) | (_req_type << 4) | (_frm_type << 7);
-    return initFrame;
-}
-
 void PL455::writeRegister(uint8_t scope, uint8_t device_addr, uint8_t register_addr, const uint8_t *data, uint8_t data_size)
 {
-    uint8_t frameSize = 0;
-    uint8_t _initFrame = getInitFrame(1, scope, data_size);
-
-    switch (scope)
-    {
-    case SCOPE_SINGLE:
-    case SCOPE_GROUP:
-        frameSize = data_size + 3 + ADDR_SIZE; // data, plus register address(es), plus device or group ID, plus command frame (CRC is calculated and added in send_Frame())
-        break;
-    case SCOPE_BRDCST:
-        frameSize = data_size + 2 + ADDR_SIZE; // no group or device ID
-        break;
-    default: 
-        // panic!
-        LOG_ERR("ERROR: Bad scope - %d!\n", scope);
-    }
-    uint8_t frame[frameSize];
-    frame[0] = _initFrame;
-    switch (scope)
-    {
-    case SCOPE_SINGLE:
-    case SCOPE_GROUP:
-        frame[1] = device_addr;
-        frame[2] = 0;
-        frame[2 + ADDR_SIZE] = register_addr;
-        break;
-    case SCOPE_BRDCST:
-        frame[1] = 0;
-        frame[1 + ADDR_SIZE] = register_addr;
-        break;
-    }
-    for (uint8_t i = 0; i < data_size; i++)
-    {
-        frame[frameSize - data_size + i] = data[data_size - i - 1];
-    }
-    send_Frame(frame, frameSize);
+    // queued and sent back to back by the link, no response to wait for
+    mLink.write(scope, device_addr, register_addr, data, data_size);
 }
 
-void PL455::readRegister(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t uint8_tsToReturn)
+int PL455::readRegister(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t uint8_tsToReturn, uint8_t *response, int size)
 {
-    uint8_t frameSize = 0;
-    uint8_t _initFrame = getInitFrame(0, scope, 1);
-
-    switch (scope)
-    {
-    case SCOPE_SINGLE:
-    case SCOPE_BRDCST:
-        frameSize = 4 + ADDR_SIZE; // command frame, (max) device address, register address (2 uint8_ts if ADDR_SIZE=1), number of uint8_ts to return
-        break;
-    case SCOPE_GROUP:
-        frameSize = 5 + ADDR_SIZE; // command frame, group ID, register address, max device address, number of uint8_ts to return
-        break;
-    default: 
-        // panic!
-        LOG_ERR("ERROR: Bad scope - %d!\n", scope);
-    }
-    uint8_t frame[frameSize];
-    frame[0] = _initFrame;
-    switch (scope)
-    {
-    case SCOPE_GROUP:
-        frame[1] = group_id;
-        frame[2] = 0;
-        frame[2 + ADDR_SIZE] = register_addr;
-        frame[3 + ADDR_SIZE] = device_addr;
-        break;
-    case SCOPE_SINGLE:
-        frame[1] = device_addr;
-        frame[2] = 0;
-        frame[2 + ADDR_SIZE] = register_addr;
-        break;
-    case SCOPE_BRDCST:
-        frame[1] = 0;
-        frame[1 + ADDR_SIZE] = register_addr;
-        frame[2 + ADDR_SIZE] = device_addr;
-    }
-    frame[frameSize - 1] = uint8_tsToReturn - 1;
-    send_Frame(frame, frameSize);
-    registerRequested = register_addr;
-    deviceRequested = device_addr;
-    scopeRequested = scope;
-    waitingForResponse = 1;
-    sentRequest = 1;
-    commTimeout = 0;
+    // blocks until the response arrives or COMM_TIMEOUT passes
+    return mLink.read(scope, device_addr, group_id, register_addr, uint8_tsToReturn, response, size);
 }
 
 void PL455::init()
 {   
     //'bmsbaud' sets the baud once running - the first frame is always 250000baud.
     bmsSteps = 100 / (100 - BALANCE_DUTYCYCLE); // managed balancing/voltage measurement
-    bmsStepPeriod = BMS_CYCLE_PERIOD / bmsSteps;
+    bmsStepPeriod = k_us_to_ticks_ceil64(cyclePeriodUs / bmsSteps);
+    int64_t initStart = k_uptime_get();
 
-    //commReset(1);
     wakeup();
-    k_sleep(K_MSEC(100)); 
 
-    uint8_t baudsetting = 1;
+    PL455Topology cached = {};
+    bool haveCache = (PL455TopologyLoad(mChain, cached) == 0) && (cached.configSignature == configSignature()) &&
+                     (cached.numModules != 0) && (cached.numModules <= maxDevices);
+    if (haveCache && verifyAddresses(cached.numModules))
+    {
+        // the chain stayed awake through our reset (e.g. watchdog) and still has its addresses
+        numModules = cached.numModules;
+        LOG_INF("Chain %d: %d modules still addressed\n", mChain, numModules);
+        configure();
+        configureComms();
+        timingStats.initMs = k_uptime_get() - initStart;
+        return;
+    }
 
+    k_sleep(K_MSEC(100)); 
 
     // send packet to change speed to baud
-    uint8_t commdata[2] = {0, 0};
-    commdata[0] = 0b11100000;       // enable all comms apart from fault
-    commdata[1] = baudsetting << 4; // set UART baud
-    writeRegister(SCOPE_BRDCST, 0, 0x10, commdata, 2);
+    mLink.write(REG10_FRAME);
     // BMS.flush(); // give time for the serial to be sent
 
     k_sleep(K_MSEC(2));  // at least 10usec
     
     configure();           // general config
-    setAddresses();
-    
+    if (haveCache)
+    {
+        // hand out the addresses we expect and check them with one read, instead of probing. One more
+        // address goes out and must stay unanswered - a device added to the end would take it.
+        bool roomForMore = cached.numModules < maxDevices;
+        assignAddresses(cached.numModules + (roomForMore ? 1 : 0), false);
+        if (verifyAddresses(cached.numModules) && !(roomForMore && addressAnswers(cached.numModules)))
+        {
+            numModules = cached.numModules;
+            LOG_INF("Chain %d: %d modules as cached\n", mChain, numModules);
+        }
+        else
+        {
+            haveCache = false;
+        }
+    }
+    if (!haveCache)
+    {
+        setAddresses();
+        if (numModules != 0)
+        {
+            PL455Topology topology = {numModules, configSignature()};
+            PL455TopologySave(mChain, topology);
+        }
+    }
+    configureComms();
+    timingStats.initMs = k_uptime_get() - initStart;
+}
+
+void PL455::configureComms()
+{
     // now do per-device configuration
+    uint8_t commdata[2] = {0, REG10[1]};
     switch (numModules)
     {
     case 0: // no modules connected!!
@@ -432,33 +405,83 @@ void PL455::init()
         writeRegister(SCOPE_SINGLE, 0, 0x10, commdata, 2);
         break;
     default:                      // more than one module
-        commdata[0] = 0b11000000; // enable UART and high side comms, not fault - first module
+        commdata[0] = 0b11000000 | COMM_FAULT_HIGH; // enable UART and high side comms, faults from above if comparators are used - first module
         writeRegister(SCOPE_SINGLE, 0, 0x10, commdata, 2);
         for (int i = 1; i < numModules - 1; i++)
         {
-            commdata[0] = 0b01100000; // enable high and low side comms, not fault, disable UART - middle modules
+            commdata[0] = 0b01100000 | COMM_FAULT_HIGH | COMM_FAULT_LOW; // enable high and low side comms, disable UART - middle modules
             writeRegister(SCOPE_SINGLE, i, 0x10, commdata, 2);
         }
-        commdata[0] = 0b00100000; // enable low side comms, not fault, disable high side and UART - last module
+        commdata[0] = 0b00100000 | COMM_FAULT_LOW; // enable low side comms, disable high side and UART - last module
         writeRegister(SCOPE_SINGLE, numModules - 1, 0x10, commdata, 2);
         break;
     }
-    commTimeout = 0;
+}
+
+uint16_t PL455::configSignature()
+{
+    // CRC over every configuration frame we send - any register change gives a new signature
+    const uint8_t *frames[] = {REG07_FRAME.bytes, REG0D_FRAME.bytes, REG0E_FRAME.bytes, REG0F_FRAME.bytes,
+                               REG10_FRAME.bytes, REG13_FRAME.bytes, REG1E_FRAME.bytes, REG28_FRAME.bytes,
+                               REG32_FRAME.bytes, REG03_FRAME.bytes, REG3E_FRAME.bytes, REG3F_FRAME.bytes,
+                               REG6E_FRAME.bytes, REG8C_FRAME.bytes, REG8D_FRAME.bytes, REG33_FRAME.bytes};
+    const uint8_t sizes[] = {sizeof(REG07_FRAME), sizeof(REG0D_FRAME), sizeof(REG0E_FRAME), sizeof(REG0F_FRAME),
+                             sizeof(REG10_FRAME), sizeof(REG13_FRAME), sizeof(REG1E_FRAME), sizeof(REG28_FRAME),
+                             sizeof(REG32_FRAME), sizeof(REG03_FRAME), sizeof(REG3E_FRAME), sizeof(REG3F_FRAME),
+                             sizeof(REG6E_FRAME), sizeof(REG8C_FRAME), sizeof(REG8D_FRAME), sizeof(REG33_FRAME)};
+    uint16_t signature = 0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(frames); i++)
+    {
+        for (unsigned int j = 0; j < sizes[i]; j++)
+        {
+            signature = CRC16Update(signature, frames[i][j]);
+        }
+    }
+    return signature;
 }
 
 void PL455::configure()
 {
-    writeRegister(SCOPE_BRDCST, 0, 0x07, REG07, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x0D, REG0D, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x0E, REG0E, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x0F, REG0F, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x13, REG13, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x1E, REG1E, 2);
-    writeRegister(SCOPE_BRDCST, 0, 0x28, REG28, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x32, REG32, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x03, REG03, 4);
-    writeRegister(SCOPE_BRDCST, 0, 0x3E, REG3E, 1);
-    writeRegister(SCOPE_BRDCST, 0, 0x3F, REG3F, 4);
+    writeOversampling();
+    mLink.write(REG0D_FRAME);
+    mLink.write(REG0E_FRAME);
+    mLink.write(REG0F_FRAME);
+    mLink.write(REG13_FRAME);
+    mLink.write(REG1E_FRAME);
+    mLink.write(REG28_FRAME);
+    mLink.write(REG03_FRAME);
+    armAutoMonitor();
+    mLink.write(REG3E_FRAME);
+    mLink.write(REG3F_FRAME);
+#if PL455_CMP_ENABLE
+    mLink.write(REG8C_FRAME);
+    mLink.write(REG8D_FRAME);
+    mLink.write(REG6E_FRAME);
+#endif
+}
+
+void PL455::armAutoMonitor()
+{
+#if PL455_AUTOMONITOR
+    mLink.write(REG33_FRAME); // channels before the period, the first conversion already covers all of them
+#endif
+    mLink.write(REG32_FRAME);
+}
+
+void PL455::setOversampling(PL455Oversampling profile)
+{
+    atomic_set(&oversampling, MIN(uint8_t(profile), ARRAY_SIZE(REG07_PROFILES) - 1));
+}
+
+void PL455::writeOversampling()
+{
+    uint8_t profile = atomic_get(&oversampling);
+    mLink.writeFrame(REG07_PROFILES[profile], sizeof(REG07_FRAME));
+    if (writtenOversampling != 0xFF)
+    {
+        LOG_INF("Chain %d: oversampling profile %d\n", mChain, profile);
+    }
+    writtenOversampling = profile;
 }
 
 int PL455::getNumModules()
@@ -466,291 +489,1228 @@ int PL455::getNumModules()
     return int(numModules);
 }
 
-void PL455::setAddresses()
+void PL455::assignAddresses(uint8_t count, bool paced)
 {
-    writeRegister(SCOPE_BRDCST, 0, 0x0C, REG0C, 1); // starts autoaddressing
-    for (uint8_t i = 0; i < MAX_MODULES; i++)
+    mLink.write(REG0C_FRAME); // starts autoaddressing
+    for (uint8_t i = 0; i < count; i++)
     {
-        k_sleep(K_MSEC(20)); 
+        if (paced)
+        {
+            k_sleep(K_MSEC(20)); 
+        }
         uint8_t addr[1] = {i};
         writeRegister(SCOPE_BRDCST, 0, 0x0A, addr, 1); // address 0 - 15
     }
+}
+
+void PL455::setAddresses()
+{
+    assignAddresses(maxDevices, true);
     // all modules will now have an address. Now we check with each one until we get no response.
-    elapsedMillis timeout;
     uint8_t checkModule = 0;
-    while (timeout < 1000)
-    { 
-        // allow 1000ms for each module to respond. This should be more than enough!!!
-        listenSerial();
-
-        if ((!sentRequest) && (checkModule != MAX_MODULES))
-        {                                                        // haven't sent our request yet, but don't ask for addresses > 15 (16th module)
-            readRegister(SCOPE_SINGLE, checkModule, 0, 0x0A, 1); // read address of module
-            timeout = 0;                                         // don't include time taken to send request
-        }
-        else if (!waitingForResponse)
-        { // just received a response
-            if (uint8_tsReceived == 4)
-            { // init uint8_t, data uint8_t, 2 CRC uint8_ts
-                uint8_t received[uint8_tsReceived];
-                for (int i = 0; i < uint8_tsReceived; i++)
-                {
-                    received[i] = serialRXbuffer[i]; // copy into new array
-                }
-                if (received[1] == checkModule)
-                { // received the right address back
-                    checkModule++;
-                    timeout = 0;
-                    waitingForResponse = 0;
-                    sentRequest = 0;
-                }
-            }
-        } // otherwise, we have sent a request, but haven't received a response yet
+    uint8_t response[4];
+    while (checkModule != maxDevices)
+    {                                                                                           // don't ask for addresses > 15 (16th module)
+        int received = readRegister(SCOPE_SINGLE, checkModule, 0, 0x0A, 1, response, sizeof(response)); // read address of module
+        if ((received != 4) || (response[1] != checkModule))
+        { // init uint8_t, data uint8_t, 2 CRC uint8_ts - anything else is not the right address back
+            break;
+        }
+        checkModule++;
     }
     // timed out waiting for response, last module must have been the highest address
     numModules = checkModule;
-    LOG_INF("Discovered %d modules\n", numModules);
+    LOG_INF("Chain %d: discovered %d modules\n", mChain, numModules);
+}
+
+namespace {
+    struct AddressCheck
+    {
+        struct k_sem done;
+        uint8_t count;
+        uint8_t matched;
+    };
+
+    void onAddress(void *context, int status, uint8_t index, const uint8_t *response, int length)
+    {
+        // responses come highest address first
+        AddressCheck *check = static_cast<AddressCheck *>(context);
+        if (status == 0 && length == 4 && response[1] == check->count - 1 - index)
+        {
+            check->matched++;
+        }
+        if (status != 0 || index == check->count - 1)
+        {
+            k_sem_give(&check->done);
+        }
+    }
+} // anonymous namespace
+
+bool PL455::addressAnswers(uint8_t address)
+{
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Read;
+    transaction.scope = SCOPE_SINGLE;
+    transaction.device = address;
+    transaction.reg = 0x0A;
+    transaction.dataSize = 1;
+    transaction.data[0] = 0; // 1 byte back
+    transaction.responses = 1;
+    transaction.responseSize = 4;
+    transaction.timeout = PL455_TOPOLOGY_TIMEOUT;
+    uint8_t response[4];
+    return (mLink.transfer(transaction, response, sizeof(response)) == 4) && (response[1] == address);
 }
 
-uint16_t PL455::CRC16(uint8_t *message, int mlength)
+bool PL455::verifyAddresses(uint8_t count)
 {
-    uint16_t CRC = 0;
+    // one broadcast read of the address register - every device up to count-1 answers with its address
+    AddressCheck check;
+    k_sem_init(&check.done, 0, 1);
+    check.count = count;
+    check.matched = 0;
 
-    for (int i = 0; i < mlength; i++)
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Read;
+    transaction.scope = SCOPE_BRDCST;
+    transaction.device = count - 1; // highest device address to respond
+    transaction.reg = 0x0A;
+    transaction.dataSize = 1;
+    transaction.data[0] = 0;        // 1 byte back
+    transaction.responses = count;
+    transaction.responseSize = 4;
+    transaction.timeout = PL455_TOPOLOGY_TIMEOUT;
+    transaction.callback = onAddress;
+    transaction.context = &check;
+    if (mLink.submit(transaction) != 0)
     {
-        CRC ^= (*message++) & 0x00FF;
-        CRC = crc16_table[CRC & 0x00FF] ^ (CRC >> 8);
+        return false;
     }
-    return CRC;
+    k_sem_take(&check.done, K_FOREVER); // the link always completes, at worst by timing out
+    return check.matched == count;
 }
 
-void PL455::send_Frame(uint8_t *message, int messageLength)
+void PL455::sampleAll(Sample kind)
 {
-    uint16_t CRC;
-    CRC = CRC16(message, messageLength);
-    uint8_t toSend[messageLength + 2]; //+2 for CRC
-    for (int i = 0; i < messageLength; i++)
+    // broadcast "sample and send" to the command register. Every device starts converting on
+    // the same frame, then they all answer back to back, highest address first.
+    sampleKind = kind;
+    acquisitionStart = k_uptime_ticks();
+    if (numModules == 0)
     {
-        toSend[i] = message[i];
+        if (reinitStage != Reinit::Idle)
+        {
+            return; // being looked for again (or waiting to) - nothing to measure and nothing to recover yet
+        }
+        // nothing to ask - straight to the recovery ladder, which ends in looking for the chain again
+        voltsStatus = -ENODEV;
+        k_work_submit_to_queue(&mQueue, &voltagesWork.work);
+        return;
+    }
+    if (currentPathActive())
+    {
+        // the first device only has the current channel selected between scans
+        mLink.write(REG03_FRAME);
+        fullScanPending = true;
     }
-    toSend[messageLength] = CRC & 0x00FF;
-    toSend[messageLength + 1] = (CRC & 0xFF00) >> 8;
-    LOG_DBG("Sending 0x");
-    for (int i = 0; i < messageLength + 2; i++)
+    for (uint8_t module = 0; module < numModules; module++)
     {
-        uart_poll_out(uartDev, toSend[i]);
-        LOG_DBG("%x ", toSend[i]);
+        devices[module].sampleMask = (kind == Sample::Off) ? 0 : devices[module].balanceShadow;
     }
-    LOG_DBG("\n");
+
+    // with auto-monitor the devices have converted on their own, they only need to send the results
+    readingLast = PL455_AUTOMONITOR && !commandNextSample;
+    commandNextSample = false;
+
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Command;
+    transaction.scope = SCOPE_BRDCST;
+    transaction.reg = 0x02;                 // command register
+    transaction.dataSize = 1;
+    transaction.data[0] = (numModules - 1) | (readingLast ? CMD_SEND_LAST : 0); // highest device address to respond
+    transaction.device = numModules - 1;
+    transaction.responses = numModules;
+    transaction.responseSize = VOLTAGES_RESPONSE_SIZE;
+    transaction.timeout = COMM_TIMEOUT;
+    transaction.retries = PL455_RETRIES;
+    transaction.callback = onVoltages;
+    transaction.context = this;
+    mLink.submit(transaction);
 }
 
-void PL455::listenSerial()
+void PL455::onVoltages(void *context, int status, uint8_t index, const uint8_t *response, int length)
 {
-    uint8_t data;
-
-    // captures all the serial RX
-    while (uart_poll_in(uartDev, &data) == 0)
+    // runs on the link thread, once per device response
+    PL455 *self = static_cast<PL455 *>(context);
+    if (index == 0)
     {
-        LOG_DBG("data received: %x\n", data);
-        if (waitingForResponse)
-        { 
-            // if we're not looking for a response, this is definately noise.
-            if (!rxInProgress)
-            { 
-                // first uint8_t of response
-                // check this is a response uint8_t
-                bool respuint8_t = (data >> 7) & 1;
-                uint8_t numuint8_ts = data & 0b01111111;
-                if ((respuint8_t == 0) && (numuint8_ts <= 128))
-                { 
-                    // probably a response uint8_t
-                    serialRXbuffer[0] = data;
-                    uint8_tsToReceive = numuint8_ts + 1; // number of _data_ uint8_ts to receive. Also receive the init uint8_t, plus two CRC uint8_ts
-                    uint8_tsReceived = 1;
-                    rxInProgress = 1;
-                }
-                else
-                { 
-                    // not a response uint8_t - void
-                    rxInProgress = 0;
-                    uint8_tsToReceive = 0;
-                    uint8_tsReceived = 0;
-                }
-            }
-            else
-            { 
-                // subsequent uint8_ts
-                serialRXbuffer[uint8_tsReceived] = data;
-                uint8_tsReceived++;
-                LOG_DBG("received: %d, to receive: %d\n", uint8_tsReceived, uint8_tsToReceive);
-            }
-
-            if (uint8_tsReceived == uint8_tsToReceive + 3)
-            { 
-                // received complete frame
-                uint8_t completeFrame[uint8_tsReceived];
-                LOG_DBG("Received 0x");
-                for (int i = 0; i < uint8_tsReceived; i++)
-                {
-                    completeFrame[i] = serialRXbuffer[i]; // copy frame to new array
-                    LOG_DBG("%x ", completeFrame[i]);
-                }
-                LOG_DBG("\n");
-                if (CRC16(completeFrame, uint8_tsReceived) == 0)
-                { 
-                    // CRC checks ok
-                    waitingForResponse = 0;
-                    rxInProgress = 0;
-                    uint8_tsToReceive = 0;
-                    commTimeout = 0;
-                }
-                else
-                { 
-                    // void
-                    rxInProgress = 0;
-                    uint8_tsToReceive = 0;
-                    uint8_tsReceived = 0;
-                }
-            }
+        self->voltsStatus = 0;
+    }
+    if (status == 0)
+    {
+        int ret = self->storeVoltages(self->numModules - 1 - index, response, length);
+        if (ret != 0)
+        {
+            self->voltsStatus = ret; // one unusable device fails the whole scan
+        }
+    }
+    if ((status != 0) || (index == self->numModules - 1))
+    {
+        // the rest of the processing queues more link traffic, so it can't run on the link thread
+        if (status != 0)
+        {
+            self->voltsStatus = status;
         }
+        k_work_submit_to_queue(&self->mQueue, &self->voltagesWork.work);
     }
 }
 
-void PL455::runBMS()
-{ 
-    mGPIO.Toggle(GPIO::Name::LED0);
-    // called frequently from main()
-    listenSerial();
-    if (commTimeout > COMM_TIMEOUT)
-    { 
-        // no response
-        LOG_ERR("ERROR: comms timeout?\n");
-        commTimeout = 500; // don't spam the console
-    }
-    if (micros() - bmsStepPeriod > bmsStepTime)
-    {
-        if (bmsStep == 0)
-        { 
-            // first step - turn off balancing
-            uint8_t balanceDisable[2] = {0, 0};
-            writeRegister(SCOPE_BRDCST, numModules - 1, 0x14, balanceDisable, 2);
-            bmsStepTime = micros();
-            bmsStep++;
-        }
-        else if (bmsStep == 1)
-        { 
-            // second step, read voltages
-            // PL455::readRegister(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t uint8_tsToReturn);
-            if (voltsRequested == 0)
-            {                                                                  // nothing requested yet
-                readRegister(SCOPE_SINGLE, voltsRequested, 0, 0x02, 1); // slightly abuse the readRegister function to send a command
-                voltsRequested++;
-            }
-            else if (waitingForResponse == 0)
-            { 
-                // received a response
-                // reset flags
-                registerRequested = 0;
-                deviceRequested = 0;
-                scopeRequested = 0;
-                sentRequest = 0;
-                
-                // read response
-                for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
-                {
-                    uint16_t reading;
-                    reading = (serialRXbuffer[2 * cell + 1] << 8) | serialRXbuffer[2 * cell + 2];
-                    cellVoltages[voltsRequested - 1][15 - cell] = reading;
-                }
+int PL455::storeVoltages(uint8_t module, const uint8_t *response, int length)
+{
+    // response is init byte, 16 cells, 8 aux, module voltage (all 16bit, highest channel first), 2 CRC bytes
+    if (length != VOLTAGES_RESPONSE_SIZE)
+    {
+        LOG_ERR("ERROR: unexpected %d byte response from module %d!\n", length, module);
+        return -EIO;
+    }
 
-                for (unsigned int aux = 0; aux < 8; aux++)
-                {
-                    uint16_t reading;
-                    reading = (serialRXbuffer[2 * aux + 33] << 8) | serialRXbuffer[2 * aux + 34];
-                    auxVoltages[voltsRequested - 1][7 - aux] = reading;
-                }
-                
-                moduleVoltages[voltsRequested - 1] = (serialRXbuffer[49] << 8) | serialRXbuffer[50];
-                
-                if (voltsRequested == numModules)
-                { 
-                    // received the last module data
-                    voltsRequested = 0;
-                    // update data
-                    findMinMaxCellVolt();
-                    chooseBalanceCells();
-                    // turn balancing back on
-                    for (unsigned int module = 0; module < numModules; module++)
-                    {
-                        uint8_t balanceEnable[2] = {0, 0};
-                        for (unsigned int cell = 0; cell < 8; cell++)
-                        {
-                            balanceEnable[0] = balanceEnable[0] | (balanceCells[module][cell] << cell);
-                        }
-                        for (unsigned int cell = 8; cell < NUM_CELLS; cell++)
-                        {
-                            balanceEnable[1] = balanceEnable[1] | (balanceCells[module][cell] << (cell - 8));
-                        }
-                        writeRegister(SCOPE_SINGLE, module, 0x14, balanceEnable, 2);
-                    }
-                    // reset flags
-                    bmsStepTime = micros();
-                    bmsStep++;
-                }
-                else
-                {
-                    readRegister(SCOPE_SINGLE, voltsRequested, 0, 0x02, 1);
-                    voltsRequested++; // don't reset the step timer - make sure this happens as quick as possible
-                }
-            }
+    uint16_t readings[NUM_CELLS];
+    for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
+    {
+        readings[15 - cell] = (response[2 * cell + 1] << 8) | response[2 * cell + 2];
+    }
+
+    k_mutex_lock(&dataLock, K_FOREVER);
+    if (readingLast)
+    {
+        // with 25 noisy channels, a frame identical to the last one (same CRC) is the same
+        // conversion sent again - the device isn't auto-monitoring. Don't feed it to the filters twice.
+        uint16_t resultCrc = response[length - 2] | (response[length - 1] << 8);
+        if (resultCrc == devices[module].resultCrc)
+        {
+            devices[module].staleReads++;
+            staleReads++;
+            k_mutex_unlock(&dataLock);
+            return 0; // checkAutoMonitor() deals with it
         }
-        else
-        { 
-            // other steps, keep balancing on
-            for (unsigned int module = 0; module < numModules; module++)
+        devices[module].resultCrc = resultCrc;
+        devices[module].staleReads = 0;
+    }
+    switch (sampleKind)
+    {
+    case Sample::Calibrate:
+        // only a reference - the off sample a couple of steps later is what gets used
+        memcpy(devices[module].calibrationReadings, readings, sizeof(readings));
+        devices[module].calibrationMask = devices[module].sampleMask;
+        break;
+    case Sample::Off:
+        if (calibrating)
+        {
+            learnBalanceDrop(module, readings);
+        }
+        memcpy(devices[module].cellVoltages, readings, sizeof(readings));
+        break;
+    case Sample::On:
+        for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
+        {
+            uint16_t bit = 1 << cell;
+            if (!(devices[module].sampleMask & bit))
             {
-                uint8_t balanceEnable[2] = {0, 0};
-                for (unsigned int cell = 0; cell < 8; cell++)
-                {
-                    balanceEnable[0] = balanceEnable[0] | (balanceCells[module][cell] << cell);
-                }
-                for (unsigned int cell = 8; cell < NUM_CELLS; cell++)
-                {
-                    balanceEnable[1] = balanceEnable[1] | (balanceCells[module][cell] << (cell - 8));
-                }
-                writeRegister(SCOPE_SINGLE, module, 0x14, balanceEnable, 2);
+                devices[module].cellVoltages[cell] = readings[cell];
             }
-            bmsStepTime = micros();
-            bmsStep++;
-            if (bmsStep >= bmsSteps)
+            else if (devices[module].balanceDropValid & bit)
             {
-                bmsStep = 0;
+                devices[module].cellVoltages[cell] = CLAMP(readings[cell] + devices[module].balanceDrop[cell], 0, 65535);
+            }
+            else
+            {
+                // no correction known yet - keep the last good value and calibrate next cycle
+                needCalibration = true;
             }
         }
+        break;
     }
+
+    for (unsigned int aux = 0; aux < 8; aux++)
+    {
+        uint16_t reading;
+        reading = (response[2 * aux + 33] << 8) | response[2 * aux + 34];
+        devices[module].auxVoltages[7 - aux] = reading;
+    }
+
+    devices[module].moduleVoltage = (response[49] << 8) | response[50];
+    k_mutex_unlock(&dataLock);
+    return 0;
 }
 
-void PL455::fillModuleData(ModuleData &moduleData)
+void PL455::learnBalanceDrop(uint8_t module, const uint16_t *offReadings)
 {
-    for (unsigned int module = 0; module < numModules; module++)
+    // each on/off pair gives the drop across the bleed path; smoothed so one noisy pair doesn't stick
+    for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
     {
-        for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
+        uint16_t bit = 1 << cell;
+        if (!(devices[module].calibrationMask & bit))
+        {
+            continue;
+        }
+        int16_t drop = int32_t(offReadings[cell]) - int32_t(devices[module].calibrationReadings[cell]);
+        if (devices[module].balanceDropValid & bit)
+        {
+            devices[module].balanceDrop[cell] += (drop - devices[module].balanceDrop[cell]) / 4;
+        }
+        else
         {
-            moduleData.cellStates[module*16 + cell].voltage = getCellVoltage(module, cell);
-            moduleData.cellStates[module*16 + cell].balancing = getBalanceStatus(module, cell);
+            devices[module].balanceDrop[cell] = drop;
+            devices[module].balanceDropValid |= bit;
         }
     }
-    moduleData.moduleState.m1Voltage = getModuleVoltage(0) / 10;
-    moduleData.moduleState.m2Voltage = getModuleVoltage(1) / 10;
-    moduleData.moduleState.current = (getAuxVoltage(0, 7) - 25000) * 18;
-    moduleData.moduleState.temperature = 250; // 25*C
+}
 
-    for (unsigned int module = 0; module < numModules; module++)
+bool PL455::balancingActive()
+{
+    for (uint8_t module = 0; module < numModules; module++)
     {
-        for (unsigned int adc = 0; adc < 8; adc++)
+        if (devices[module].balanceShadow)
         {
-            moduleData.adcStates[module*8 + adc] = getAuxVoltage(module, adc);
-            moduleData.adcStates[module*8 + adc] = getAuxVoltage(module, adc);
+            return true;
         }
     }
-}
\ No newline at end of file
+    return false;
+}
+
+void PL455::start(int64_t firstStepTicks)
+{
+    startFaultMonitor();
+
+    if (currentPathActive())
+    {
+        selectCurrentChannel();
+        currentWork.owner = this;
+        k_work_init_delayable(&currentWork.work, onCurrentTick);
+        currentDeadline = firstStepTicks + k_us_to_ticks_ceil64(PL455_CURRENT_SAMPLE_PERIOD_US);
+        k_work_schedule_for_queue(&mQueue, &currentWork.work, K_TIMEOUT_ABS_TICKS(currentDeadline));
+    }
+
+    stepWork.owner = this;
+    voltagesWork.owner = this;
+    captureStartWork.owner = this;
+    captureDoneWork.owner = this;
+    k_work_init(&captureStartWork.work, onCaptureStart);
+    k_work_init(&captureDoneWork.work, onCaptureDone);
+    k_work_init_delayable(&stepWork.work, onStep);
+    k_work_init(&voltagesWork.work, onVoltagesReady);
+    reinitWork.owner = this;
+    k_work_init_delayable(&reinitWork.work, onReinitStep);
+
+    bmsStepDeadline = firstStepTicks;
+    k_work_schedule_for_queue(&mQueue, &stepWork.work, K_TIMEOUT_ABS_TICKS(bmsStepDeadline));
+}
+
+void PL455::onStep(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    CONTAINER_OF(dwork, StepWork, work)->owner->runBMS();
+}
+
+void PL455::onVoltagesReady(struct k_work *work)
+{
+    CONTAINER_OF(work, Work, work)->owner->processVoltages();
+}
+
+void PL455::runBMS()
+{ 
+    // runs on the bms work queue, once per step period
+    int64_t now = k_uptime_ticks();
+    int64_t lateness = k_ticks_to_us_floor64(now - bmsStepDeadline);
+    timingStats.steps++;
+    timingStats.totalLatenessUs += lateness;
+    timingStats.minLatenessUs = (timingStats.steps == 1) ? lateness : MIN(timingStats.minLatenessUs, lateness);
+    timingStats.maxLatenessUs = MAX(timingStats.maxLatenessUs, lateness);
+
+    if (mChain == 0)
+    {
+        mGPIO.Toggle(GPIO::Name::LED0);
+    }
+    if (bmsStep == 0)
+    {
+        // first step - decide how this cycle measures. Balancing is only turned off for a
+        // measurement every BALANCE_OFF_MEASURE_CYCLES, or when a cell has no drop learned yet.
+        bool offCycle = !BALANCE_MEASURE_WHILE_ON || needCalibration || (++cyclesSinceOff >= BALANCE_OFF_MEASURE_CYCLES);
+        calibrating = offCycle && BALANCE_MEASURE_WHILE_ON && balancingActive();
+        offStep = !offCycle ? 0xFF : (calibrating ? 1 : 0);
+        if (offCycle)
+        {
+            cyclesSinceOff = 0;
+            needCalibration = false;
+        }
+        if (atomic_get(&oversampling) != writtenOversampling)
+        {
+            writeOversampling(); // goes out ahead of this cycle's first sample
+        }
+    }
+
+    if (captureActive())
+    {
+        // a burst capture has the chain - only keep the balancing FETs where they are
+        enableBalancing();
+    }
+    else if (bmsStep == offStep)
+    { 
+        // turn off balancing
+        mLink.write(REG14_OFF_FRAME);
+        clearBalanceShadow();
+    }
+    else if (bmsStep == offStep + 1)
+    { 
+        // read voltages with balancing off. Balancing is turned back on as soon as the last response is in.
+        sampleAll(Sample::Off); // every device converts on this one frame (or has, a step after the switches went off)
+    }
+    else if (bmsStep == 0)
+    {
+        // read voltages with balancing left on - corrected, or as the reference for the off sample
+        sampleAll(calibrating ? Sample::Calibrate : Sample::On);
+    }
+    else
+    { 
+        // other steps, keep balancing on - the REG13 timer holds the FETs, so this only
+        // writes if the mask changed or the timer needs a refresh
+        enableBalancing();
+    }
+    bmsStep++;
+    if (bmsStep >= bmsSteps)
+    {
+        bmsStep = 0;
+        bmsStepPeriod = k_us_to_ticks_ceil64(cyclePeriodUs / bmsSteps); // rate changes only between cycles
+    }
+
+    // next step on the fixed grid - time spent here or in other threads doesn't push it around
+    bmsStepDeadline += bmsStepPeriod;
+    if (bmsStepDeadline <= now)
+    {
+        timingStats.overruns++;
+        while (bmsStepDeadline <= now)
+        {
+            bmsStepDeadline += bmsStepPeriod;
+        }
+    }
+    k_work_reschedule_for_queue(&mQueue, &stepWork.work, K_TIMEOUT_ABS_TICKS(bmsStepDeadline));
+}
+
+void PL455::processVoltages()
+{
+    // received the last module data (or gave up on it)
+    uint32_t acquisitionUs = k_ticks_to_us_floor32(k_uptime_ticks() - acquisitionStart);
+    timingStats.acquisitions++;
+    timingStats.lastAcquisitionUs = acquisitionUs;
+    timingStats.maxAcquisitionUs = MAX(timingStats.maxAcquisitionUs, acquisitionUs);
+    timingStats.totalAcquisitionUs += acquisitionUs;
+    if (fullScanPending && !captureActive())
+    {
+        selectCurrentChannel();
+        fullScanPending = false;
+    }
+    if (sampleKind == Sample::Calibrate)
+    {
+        if (voltsStatus == 0)
+        {
+            // balancing stays as it is until the off sample
+            return;
+        }
+        // the reference is missing or partly old - the off sample must not learn a drop from it
+        k_mutex_lock(&dataLock, K_FOREVER);
+        for (uint8_t module = 0; module < maxDevices; module++)
+        {
+            devices[module].calibrationMask = 0;
+        }
+        k_mutex_unlock(&dataLock);
+        calibrating = false;
+        needCalibration = true;
+        recover();
+        return;
+    }
+    PL455Activity activity = PL455Activity::Fast; // lost a measurement - look again soon
+    if (readingLast)
+    {
+        checkAutoMonitor();
+    }
+    if (voltsStatus == 0)
+    {
+        // update data
+        k_mutex_lock(&dataLock, K_FOREVER);
+        filterCells();
+        findMinMaxCellVolt();
+        chooseBalanceCells();
+        activity = evaluateActivity();
+        k_mutex_unlock(&dataLock);
+        if (recoveryLevel != 0)
+        {
+            LOG_INF("Chain %d: recovered after %d failed measurements\n", mChain, recoveryLevel);
+            recoveryLevel = 0;
+        }
+        reinitBackoffMs = 0;
+    }
+    else
+    {
+        recover();
+    }
+    if (activityCallback)
+    {
+        activityCallback(activityContext, mChain, activity);
+    }
+    // turn balancing back on
+    enableBalancing();
+
+    LOG_DBG("step lateness min %lld max %lld mean %lld us, %u overruns\n",
+            timingStats.minLatenessUs, timingStats.maxLatenessUs,
+            timingStats.totalLatenessUs / timingStats.steps, timingStats.overruns);
+}
+
+void PL455::checkAutoMonitor()
+{
+    // a device that keeps sending the same results has stopped converting (reset, or lost its
+    // configuration) - set auto-monitor up again and have the next measurement convert on command
+    uint16_t stale = 0;
+    for (uint8_t module = 0; module < numModules; module++)
+    {
+        if (devices[module].staleReads >= PL455_AM_STALE_READS)
+        {
+            stale |= 1 << module;
+            devices[module].staleReads = 0;
+        }
+    }
+    if (stale)
+    {
+        LOG_WRN("Chain %d: stale auto-monitor results (devices 0x%04x), re-arming\n", mChain, stale);
+        autoMonitorRearms++;
+        armAutoMonitor();
+        commandNextSample = true;
+    }
+}
+
+void PL455::recover()
+{
+    // a measurement failed even after the link retried it. Each further failure in a row goes one
+    // step further - whatever got the chain out of sync, the next cycle tries the next fix.
+    recoveryLevel++;
+    switch (recoveryLevel)
+    {
+    case 1:
+        LOG_WRN("Chain %d: measurement lost, sending comms break\n", mChain);
+        mLink.sendBreak(PL455Op::Break);
+        break;
+    case 2:
+        LOG_WRN("Chain %d: measurement lost, sending comms reset\n", mChain);
+        mLink.sendBreak(PL455Op::Reset);
+        break;
+    default:
+        // init() would block this queue for over a second, so the re-init runs as its own steps. A chain
+        // that stays dead is looked for less and less often.
+        LOG_ERR("Chain %d: measurement lost, re-initialising in %u ms\n", mChain, reinitBackoffMs);
+        reinits++;
+        recoveryLevel = 0;
+        numModules = 0; // no steps, balancing or current samples until it is found again
+        reinitStage = Reinit::WakeHigh;
+        k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(reinitBackoffMs));
+        reinitBackoffMs = (reinitBackoffMs == 0) ? PL455_REINIT_BACKOFF_MS : MIN(reinitBackoffMs * 2, PL455_REINIT_BACKOFF_MAX_MS);
+        break;
+    }
+}
+
+void PL455::onReinitStep(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    CONTAINER_OF(dwork, StepWork, work)->owner->runReinit();
+}
+
+void PL455::runReinit()
+{
+    // runs on the bms work queue - the same sequence as init() without a cached topology,
+    // every wait is a delayed step instead of a sleep
+    switch (reinitStage)
+    {
+    case Reinit::WakeHigh:
+        reinitStart = k_uptime_get();
+        gpio_pin_set(wakeupGPIO.port, wakeupGPIO.pin, 1);
+        reinitStage = Reinit::WakeLow;
+        k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(10));
+        break;
+    case Reinit::WakeLow:
+        gpio_pin_set(wakeupGPIO.port, wakeupGPIO.pin, 0);
+        reinitStage = Reinit::Baud;
+        k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(110)); // after the pulse, then settle
+        break;
+    case Reinit::Baud:
+        mLink.write(REG10_FRAME);
+        reinitStage = Reinit::Configure;
+        k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(2));
+        break;
+    case Reinit::Configure:
+        configure();
+        mLink.write(REG0C_FRAME); // starts autoaddressing
+        reinitIndex = 0;
+        reinitStage = Reinit::Address;
+        k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(20));
+        break;
+    case Reinit::Address:
+    {
+        uint8_t addr[1] = {reinitIndex};
+        writeRegister(SCOPE_BRDCST, 0, 0x0A, addr, 1);
+        if (++reinitIndex < maxDevices)
+        {
+            k_work_reschedule_for_queue(&mQueue, &reinitWork.work, K_MSEC(20));
+            break;
+        }
+        reinitIndex = 0;
+        reinitStage = Reinit::Probe;
+        probeAddress();
+        break;
+    }
+    case Reinit::Probe:
+        // a device answered (or didn't) - the first one that doesn't ends the chain
+        if (reinitProbeOk && (++reinitIndex < maxDevices))
+        {
+            probeAddress();
+        }
+        else
+        {
+            finishReinit();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void PL455::probeAddress()
+{
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Read;
+    transaction.scope = SCOPE_SINGLE;
+    transaction.device = reinitIndex;
+    transaction.reg = 0x0A;
+    transaction.dataSize = 1;
+    transaction.data[0] = 0; // 1 byte back
+    transaction.responses = 1;
+    transaction.responseSize = 4;
+    transaction.timeout = PL455_TOPOLOGY_TIMEOUT;
+    transaction.callback = onReinitProbe;
+    transaction.context = this;
+    if (mLink.submit(transaction, K_NO_WAIT) != 0)
+    {
+        finishReinit();
+    }
+}
+
+void PL455::onReinitProbe(void *context, int status, uint8_t index, const uint8_t *response, int length)
+{
+    // runs on the link thread, the next probe is queued from the work queue
+    PL455 *self = static_cast<PL455 *>(context);
+    self->reinitProbeOk = (status == 0) && (length == 4) && (response[1] == self->reinitIndex);
+    k_work_reschedule_for_queue(&self->mQueue, &self->reinitWork.work, K_NO_WAIT);
+}
+
+void PL455::finishReinit()
+{
+    numModules = reinitIndex;
+    LOG_INF("Chain %d: discovered %d modules\n", mChain, numModules);
+    if (numModules != 0)
+    {
+        PL455Topology topology = {numModules, configSignature()};
+        PL455TopologySave(mChain, topology);
+    }
+    configureComms();
+    clearBalanceShadow(); // the devices may have lost their switches
+    if (currentPathActive())
+    {
+        selectCurrentChannel();
+    }
+    timingStats.initMs = k_uptime_get() - reinitStart;
+    reinitStage = Reinit::Idle;
+}
+
+PL455Health PL455::getHealth()
+{
+    PL455Health health = {};
+    health.uart = mUart.getStats();
+    health.link = mLink.getStats();
+    health.reinits = reinits;
+    health.recoveryLevel = recoveryLevel;
+    k_mutex_lock(&dataLock, K_FOREVER);
+    health.staleReads = staleReads;
+    k_mutex_unlock(&dataLock);
+    health.autoMonitorRearms = autoMonitorRearms;
+    return health;
+}
+
+void PL455::enableBalancing()
+{
+    // register 0x14 is only written when a device's mask differs from what it already holds,
+    // or when the REG13 timer is halfway to switching it off by itself
+    int64_t now = k_uptime_get();
+    bool refresh = (now - balanceRefreshMs) >= (REG13_BALANCE_TIME_US / 2000);
+    if (refresh)
+    {
+        balanceRefreshMs = now;
+    }
+    for (unsigned int module = 0; module < numModules; module++)
+    {
+        uint16_t mask = devices[module].balanceMask;
+        if ((mask == devices[module].balanceShadow) && !(refresh && mask))
+        {
+            continue;
+        }
+        uint8_t balanceEnable[2] = {uint8_t(mask & 0x00FF), uint8_t(mask >> 8)};
+        writeRegister(SCOPE_SINGLE, module, 0x14, balanceEnable, 2);
+        devices[module].balanceShadow = mask;
+    }
+}
+
+void PL455::clearBalanceShadow()
+{
+    for (uint8_t module = 0; module < maxDevices; module++)
+    {
+        devices[module].balanceShadow = 0;
+    }
+}
+
+PL455TimingStats PL455::getTimingStats()
+{
+    return timingStats;
+}
+
+uint8_t PL455::fillModuleData(ModuleData &moduleData, uint8_t firstSlot)
+{
+    k_mutex_lock(&dataLock, K_FOREVER);
+    for (unsigned int module = 0; (module < maxDevices) && (firstSlot + module < ModuleData::devices); module++)
+    {
+        unsigned int slot = firstSlot + module;
+        if (module >= numModules)
+        {
+            // lost or never found - no readings, and no update flags, so the master sees them missing
+            // instead of taking the last values as fresh
+            for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
+            {
+                moduleData.cellStates[slot*NUM_CELLS + cell] = {};
+            }
+            for (unsigned int adc = 0; adc < 8; adc++)
+            {
+                moduleData.adcStates[slot*8 + adc] = 0;
+            }
+            continue;
+        }
+        for (unsigned int cell = 0; cell < NUM_CELLS; cell++)
+        {
+            moduleData.cellStates[slot*NUM_CELLS + cell].voltage = getCellVoltage(module, cell);
+            moduleData.cellStates[slot*NUM_CELLS + cell].balancing = getBalanceStatus(module, cell);
+            moduleData.cellStatesUpdateFlags.set(slot*NUM_CELLS + cell);
+        }
+        for (unsigned int adc = 0; adc < 8; adc++)
+        {
+            moduleData.adcStates[slot*8 + adc] = getAuxVoltage(module, adc);
+            moduleData.adcUpdateFlags.set(slot*8 + adc);
+            if ((NTC_AUX_MASK >> adc) & 1)
+            {
+                moduleData.temperatures[slot*8 + adc] = getTemperature(module, adc);
+                moduleData.temperatureUpdateFlags.set(slot*8 + adc);
+            }
+        }
+
+        // the devices split into two halves, m1 and m2
+        if (slot < (ModuleData::devices + 1) / 2)
+        {
+            moduleData.moduleState.m1Voltage += getModuleVoltage(module) / 10;
+        }
+        else
+        {
+            moduleData.moduleState.m2Voltage += getModuleVoltage(module) / 10;
+        }
+
+        if (slot == 0)
+        {
+            // 10mA steps - in 0.1mA an int16_t would saturate at 3.2A
+            moduleData.moduleState.current = CLAMP(((getAuxVoltage(module, 7) - 25000) * 18) / 100, INT16_MIN, INT16_MAX);
+            if (currentPathActive() && currentSamples != 0)
+            {
+                // the mean of every fast sample since the last publish beats one instantaneous reading
+                PL455CurrentStats current = getCurrentStats(true); // dataLock is recursive
+                moduleData.moduleState.current = CLAMP(current.mean / 100, INT16_MIN, INT16_MAX);
+                moduleData.currentState.minimum = CLAMP(current.minimum / 100, INT16_MIN, INT16_MAX);
+                moduleData.currentState.maximum = CLAMP(current.maximum / 100, INT16_MIN, INT16_MAX);
+                moduleData.currentState.mean = CLAMP(current.mean / 100, INT16_MIN, INT16_MAX);
+                moduleData.currentState.rms = MIN(current.rms / 100, UINT16_MAX);
+                moduleData.chargeState.charge = CLAMP(current.chargeMAs, INT32_MIN, INT32_MAX);
+                moduleData.chargeState.samples = current.totalSamples;
+            }
+        }
+    }
+    k_mutex_unlock(&dataLock);
+    return numModules;
+}
+
+void PL455::setFaultCallback(PL455FaultCallback callback, void *context)
+{
+    faultCallback = callback;
+    faultContext = context;
+}
+
+void PL455::startFaultMonitor()
+{
+    if (!PL455_CMP_ENABLE || !faultGPIO.port)
+    {
+        LOG_INF("Chain %d: no FAULT line, comparator faults are not reported\n", mChain);
+        return;
+    }
+    if (!gpio_is_ready_dt(&faultGPIO))
+    {
+        LOG_ERR("Error: faultGPIO device not ready\n");
+        return;
+    }
+    gpio_pin_configure_dt(&faultGPIO, GPIO_INPUT);
+    gpio_init_callback(&faultIsr.callback, onFaultIsr, BIT(faultGPIO.pin));
+    gpio_add_callback_dt(&faultGPIO, &faultIsr.callback);
+    gpio_pin_interrupt_configure_dt(&faultGPIO, GPIO_INT_EDGE_BOTH);
+
+    // the line may already be active from before we were listening
+    if (gpio_pin_get_dt(&faultGPIO) > 0)
+    {
+        k_work_submit_to_queue(&mQueue, &faultWork.work);
+    }
+}
+
+void PL455::onFaultIsr(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
+{
+    // both edges - asserting reports the fault, releasing reports it cleared
+    PL455 *self = CONTAINER_OF(cb, FaultIsr, callback)->owner;
+    k_work_submit_to_queue(&self->mQueue, &self->faultWork.work);
+}
+
+void PL455::onFaultChanged(struct k_work *work)
+{
+    CONTAINER_OF(work, Work, work)->owner->readFaults();
+}
+
+void PL455::readFaults()
+{
+    // runs on the bms work queue. Only one summary read at a time, the line may toggle faster than that.
+    if (faultReadBusy)
+    {
+        faultReadAgain = true;
+        return;
+    }
+    faultReadBusy = true;
+    faultFlags = 0;
+    faultLineActive = gpio_pin_get_dt(&faultGPIO) > 0;
+    if (numModules == 0)
+    {
+        onFaultSummary(this, -ENODEV, 0, NULL, 0);
+        return;
+    }
+
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Read;
+    transaction.scope = SCOPE_BRDCST;
+    transaction.device = numModules - 1; // highest device address to respond
+    transaction.reg = 0x52;              // fault summary
+    transaction.dataSize = 1;
+    transaction.data[0] = 1;             // 2 bytes back
+    transaction.responses = numModules;
+    transaction.responseSize = 5;
+    transaction.timeout = PL455_FAULT_TIMEOUT;
+    transaction.callback = onFaultSummary;
+    transaction.context = this;
+    if (mLink.submit(transaction) != 0)
+    {
+        onFaultSummary(this, -EIO, 0, NULL, 0);
+    }
+}
+
+void PL455::onFaultSummary(void *context, int status, uint8_t index, const uint8_t *response, int length)
+{
+    // runs on the link thread, once per device
+    PL455 *self = static_cast<PL455 *>(context);
+    if (status == 0 && length == 5)
+    {
+        uint16_t summary = (response[1] << 8) | response[2];
+        if (summary & FAULT_SUM_CMPUV)
+        {
+            self->faultFlags |= ProtectionUnderVoltage;
+        }
+        if (summary & FAULT_SUM_CMPOV)
+        {
+            self->faultFlags |= ProtectionOverVoltage;
+        }
+    }
+    else if (self->faultLineActive)
+    {
+        // the line says something tripped but we can't tell what - assume the worst
+        self->faultFlags |= ProtectionUnderVoltage | ProtectionOverVoltage;
+    }
+    if ((status != 0) || (index == self->numModules - 1))
+    {
+        k_work_submit_to_queue(&self->mQueue, &self->faultReportWork.work);
+    }
+}
+
+void PL455::onFaultRead(struct k_work *work)
+{
+    CONTAINER_OF(work, Work, work)->owner->reportFaults();
+}
+
+void PL455::reportFaults()
+{
+    uint8_t flags = faultFlags;
+    faultReadBusy = false;
+    if (flags)
+    {
+        LOG_WRN("Chain %d: comparator fault%s%s\n", mChain,
+                (flags & ProtectionUnderVoltage) ? " UV" : "", (flags & ProtectionOverVoltage) ? " OV" : "");
+    }
+    if (faultCallback)
+    {
+        faultCallback(faultContext, mChain, flags);
+    }
+    if (faultReadAgain)
+    {
+        faultReadAgain = false;
+        readFaults();
+    }
+}
+
+void PL455::setActivityCallback(PL455ActivityCallback callback, void *context)
+{
+    activityCallback = callback;
+    activityContext = context;
+}
+
+void PL455::setCyclePeriod(uint32_t periodUs)
+{
+    cyclePeriodUs = CLAMP(periodUs, BMS_CYCLE_PERIOD_MIN, BMS_CYCLE_PERIOD_MAX);
+}
+
+PL455Activity PL455::evaluateActivity()
+{
+    // called with dataLock held, right after findMinMaxCellVolt()
+    int64_t now = k_uptime_get();
+    int64_t elapsed = now - lastEvaluationMs;
+    bool haveCells = minCellVoltage <= maxCellVoltage;
+    uint32_t dvdt = 0;
+    if (haveCells && lastEvaluationMs != 0 && elapsed > 0)
+    {
+        uint32_t change = MAX(abs(maxCellVoltage - lastMaxCell), abs(minCellVoltage - lastMinCell));
+        dvdt = (change * 1000) / elapsed;
+    }
+    lastEvaluationMs = now;
+    lastMaxCell = maxCellVoltage;
+    lastMinCell = minCellVoltage;
+
+    // the shunt is on aux 7 of the first device of the first chain, same as fillModuleData()
+    int32_t current = 0;
+    if (mChain == 0 && numModules != 0)
+    {
+        current = abs((int32_t(getAuxVoltage(0, 7)) - 25000) * 18);
+    }
+
+    if ((current >= RATE_FAST_CURRENT) || (dvdt >= RATE_FAST_DVDT) ||
+        (haveCells && ((maxCellVoltage > RATE_FAST_CELL_HIGH) || (minCellVoltage < RATE_FAST_CELL_LOW))))
+    {
+        return PL455Activity::Fast;
+    }
+    if (current >= RATE_REST_CURRENT)
+    {
+        return PL455Activity::Normal;
+    }
+    return PL455Activity::Rest;
+}
+
+bool PL455::currentPathActive()
+{
+    return (PL455_CURRENT_SAMPLE_PERIOD_US != 0) && (mChain == 0) && (numModules != 0);
+}
+
+void PL455::selectCurrentChannel()
+{
+    writeRegister(SCOPE_SINGLE, 0, 0x03, REG03_CURRENT, 4);
+}
+
+void PL455::onCurrentTick(struct k_work *work)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    CONTAINER_OF(dwork, StepWork, work)->owner->sampleCurrent();
+}
+
+void PL455::sampleCurrent()
+{
+    // runs on the bms work queue, on its own fixed grid between the steps
+    if (!fullScanPending && !captureActive() && (numModules != 0))
+    {
+        PL455Transaction transaction = {};
+        transaction.op = PL455Op::Command;
+        transaction.scope = SCOPE_SINGLE;
+        transaction.device = 0;
+        transaction.reg = 0x02; // command register - sample and send, just the current channel
+        transaction.dataSize = 1;
+        transaction.data[0] = 0;
+        transaction.responses = 1;
+        transaction.responseSize = 5;
+        transaction.timeout = PL455_CURRENT_TIMEOUT;
+        transaction.callback = onCurrent;
+        transaction.context = this;
+        mLink.submit(transaction);
+    }
+
+    int64_t now = k_uptime_ticks();
+    int64_t period = k_us_to_ticks_ceil64(PL455_CURRENT_SAMPLE_PERIOD_US);
+    currentDeadline += period;
+    while (currentDeadline <= now)
+    {
+        currentDeadline += period;
+    }
+    k_work_reschedule_for_queue(&mQueue, &currentWork.work, K_TIMEOUT_ABS_TICKS(currentDeadline));
+}
+
+void PL455::onCurrent(void *context, int status, uint8_t index, const uint8_t *response, int length)
+{
+    // runs on the link thread. Init byte, aux 7, 2 CRC bytes.
+    PL455 *self = static_cast<PL455 *>(context);
+    if (status != 0 || length != 5)
+    {
+        return;
+    }
+    uint16_t reading = (response[1] << 8) | response[2];
+    self->storeCurrent((int32_t(self->adc2volt(reading)) - 25000) * 18);
+}
+
+void PL455::storeCurrent(int32_t current)
+{
+    int64_t now = k_uptime_ticks();
+    k_mutex_lock(&dataLock, K_FOREVER);
+    if (lastCurrentTicks != 0)
+    {
+        chargeUnits += current * k_ticks_to_us_floor64(now - lastCurrentTicks);
+    }
+    lastCurrentTicks = now;
+
+    if (currentSamples == 0)
+    {
+        currentMin = current;
+        currentMax = current;
+    }
+    currentMin = MIN(currentMin, current);
+    currentMax = MAX(currentMax, current);
+    currentSum += current;
+    currentSumSquares += int64_t(current) * current;
+    currentSamples++;
+    totalCurrentSamples++;
+
+    // an armed capture starts on a load step
+    if ((atomic_get(&captureState) == int(PL455CaptureState::Armed)) && (totalCurrentSamples > 1) &&
+        (abs(current - lastCurrent) >= PL455_CAPTURE_CURRENT_STEP) &&
+        atomic_cas(&captureState, int(PL455CaptureState::Armed), int(PL455CaptureState::Running)))
+    {
+        k_work_submit_to_queue(&mQueue, &captureStartWork.work);
+    }
+    lastCurrent = current;
+    k_mutex_unlock(&dataLock);
+}
+
+PL455CurrentStats PL455::getCurrentStats(bool resetWindow)
+{
+    PL455CurrentStats stats = {};
+    k_mutex_lock(&dataLock, K_FOREVER);
+    stats.samples = currentSamples;
+    if (currentSamples != 0)
+    {
+        stats.minimum = currentMin;
+        stats.maximum = currentMax;
+        stats.mean = currentSum / currentSamples;
+        stats.rms = sqrtf(float(currentSumSquares / currentSamples));
+    }
+    stats.chargeMAs = chargeUnits / 10000000; // 0.1mA * us -> mA * s
+    stats.totalSamples = totalCurrentSamples;
+    if (resetWindow)
+    {
+        currentSamples = 0;
+        currentSum = 0;
+        currentSumSquares = 0;
+    }
+    k_mutex_unlock(&dataLock);
+    return stats;
+}
+
+int PL455::startCapture(const PL455CaptureRequest &request, uint16_t *buffer, uint32_t words, bool triggerOnCurrent)
+{
+    PL455CaptureState state = PL455CaptureState(atomic_get(&captureState));
+    if (state == PL455CaptureState::Running)
+    {
+        return -EBUSY;
+    }
+    uint8_t channels = __builtin_popcount(request.cellMask) + __builtin_popcount(request.auxMask);
+    if ((request.device >= numModules) || (channels == 0) || (request.durationMs == 0) ||
+        (request.durationMs > PL455_CAPTURE_MAX_MS))
+    {
+        return -EINVAL;
+    }
+    if (words < 2u + channels)
+    {
+        return -ENOMEM;
+    }
+    if (triggerOnCurrent && !currentPathActive())
+    {
+        return -ENOTSUP;
+    }
+
+    captureRequest = request;
+    captureBuffer = buffer;
+    captureWords = words;
+    captureChannels = channels;
+    captureRecords = 0;
+    captureDurationUs = 0;
+    atomic_clear(&captureStop);
+    if (triggerOnCurrent)
+    {
+        atomic_set(&captureState, int(PL455CaptureState::Armed));
+        LOG_INF("Chain %d: capture armed on device %d\n", mChain, request.device);
+    }
+    else
+    {
+        atomic_set(&captureState, int(PL455CaptureState::Running));
+        k_work_submit_to_queue(&mQueue, &captureStartWork.work);
+    }
+    return 0;
+}
+
+void PL455::cancelCapture()
+{
+    // a running capture stops after the conversions already in flight. Only the flag is touched
+    // here, captureRequest belongs to the chain's queue and link thread while the capture runs.
+    if (!atomic_cas(&captureState, int(PL455CaptureState::Armed), int(PL455CaptureState::Idle)))
+    {
+        atomic_set(&captureStop, 1);
+    }
+}
+
+PL455CaptureInfo PL455::getCaptureInfo()
+{
+    PL455CaptureInfo info = {};
+    info.state = PL455CaptureState(atomic_get(&captureState));
+    info.device = captureRequest.device;
+    info.cellMask = captureRequest.cellMask;
+    info.auxMask = captureRequest.auxMask;
+    info.recordWords = 2 + captureChannels;
+    info.records = captureRecords;
+    info.durationUs = captureDurationUs;
+    return info;
+}
+
+bool PL455::captureActive()
+{
+    return atomic_get(&captureState) == int(PL455CaptureState::Running);
+}
+
+void PL455::onCaptureStart(struct k_work *work)
+{
+    CONTAINER_OF(work, Work, work)->owner->beginCapture();
+}
+
+void PL455::onCaptureDone(struct k_work *work)
+{
+    CONTAINER_OF(work, Work, work)->owner->endCapture();
+}
+
+void PL455::beginCapture()
+{
+    // runs on the bms work queue. Only the selected channels of one device, so every conversion
+    // and response is as short as it can be.
+    uint8_t channels[4] = {0, captureRequest.auxMask, uint8_t(captureRequest.cellMask & 0x00FF),
+                           uint8_t(captureRequest.cellMask >> 8)};
+    writeRegister(SCOPE_SINGLE, captureRequest.device, 0x03, channels, 4);
+
+    captureRequested = 0;
+    captureOutstanding = 0;
+    captureStartCycles = k_cycle_get_32();
+    LOG_INF("Chain %d: capturing %d channels of device %d for %dms\n", mChain, captureChannels,
+            captureRequest.device, captureRequest.durationMs);
+
+    // the responses must not start coming back before all of the pipeline is counted
+    k_sched_lock();
+    for (int i = 0; i < PL455_CAPTURE_PIPELINE; i++)
+    {
+        requestCaptureSample();
+    }
+    bool idle = (captureOutstanding == 0);
+    k_sched_unlock();
+    if (idle)
+    {
+        endCapture();
+    }
+}
+
+void PL455::requestCaptureSample()
+{
+    // called on the bms work queue with the scheduler locked, or on the link thread
+    uint8_t recordWords = 2 + captureChannels;
+    bool timeLeft = !atomic_get(&captureStop) &&
+                    (k_cyc_to_us_floor32(k_cycle_get_32() - captureStartCycles) < captureRequest.durationMs * 1000u);
+    bool roomLeft = (captureRequested + 1u) * recordWords <= captureWords;
+    if (!timeLeft || !roomLeft)
+    {
+        return;
+    }
+
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Command;
+    transaction.scope = SCOPE_SINGLE;
+    transaction.device = captureRequest.device;
+    transaction.reg = 0x02; // command register - sample and send the channels in REG03
+    transaction.dataSize = 1;
+    transaction.data[0] = 0;
+    transaction.responses = 1;
+    transaction.responseSize = 2 * captureChannels + 3;
+    transaction.timeout = PL455_CAPTURE_TIMEOUT;
+    transaction.callback = onCaptureSample;
+    transaction.context = this;
+    if (mLink.submit(transaction, K_NO_WAIT) == 0)
+    {
+        captureRequested++;
+        captureOutstanding++;
+    }
+}
+
+void PL455::onCaptureSample(void *context, int status, uint8_t index, const uint8_t *response, int length)
+{
+    // runs on the link thread. Init byte, the readings highest channel first (cells, then aux), 2 CRC bytes.
+    PL455 *self = static_cast<PL455 *>(context);
+    uint8_t channels = self->captureChannels;
+    if ((status == 0) && (length == 2 * channels + 3))
+    {
+        uint16_t *record = self->captureBuffer + uint32_t(self->captureRecords) * (2 + channels);
+        uint32_t time = k_cyc_to_us_floor32(k_cycle_get_32() - self->captureStartCycles);
+        record[0] = time & 0xFFFF;
+        record[1] = time >> 16;
+        uint8_t cells = __builtin_popcount(self->captureRequest.cellMask);
+        for (uint8_t i = 0; i < channels; i++)
+        {
+            // back into ascending channel order within the cells and within the aux inputs
+            uint8_t slot = (i < cells) ? (cells - 1 - i) : (channels - 1 - (i - cells));
+            record[2 + slot] = (response[2 * i + 1] << 8) | response[2 * i + 2];
+        }
+        self->captureRecords++;
+    }
+
+    self->captureOutstanding--;
+    self->requestCaptureSample();
+    if (self->captureOutstanding == 0)
+    {
+        k_work_submit_to_queue(&self->mQueue, &self->captureDoneWork.work);
+    }
+}
+
+void PL455::endCapture()
+{
+    // runs on the bms work queue once the last conversion is in
+    captureDurationUs = k_cyc_to_us_floor32(k_cycle_get_32() - captureStartCycles);
+    mLink.write(REG03_FRAME); // every channel again, the next full scan puts the current channel back
+    fullScanPending = currentPathActive();
+    atomic_set(&captureState, int(PL455CaptureState::Done));
+    LOG_INF("Chain %d: captured %d conversions in %dms\n", mChain, captureRecords, captureDurationUs / 1000);
+}
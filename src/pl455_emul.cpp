@@ -0,0 +1,477 @@
+#include "pl455_emul.h"
+#include "pl455_frame.h"
+#include "pl455_uart.h"
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/drivers/serial/uart_emul.h>
+#include <zephyr/random/random.h>
+#include <zephyr/logging/log.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+#define EMUL_UART_NODE DT_ALIAS(bquart)
+#if !DT_NODE_HAS_COMPAT(EMUL_UART_NODE, zephyr_uart_emul)
+#error "the PL455 emulator needs bquart to be a zephyr,uart-emul node"
+#endif
+
+namespace {
+    constexpr uint8_t NO_ADDRESS = 0xFF;
+    constexpr uint8_t CMD_SEND_LAST = 0b00100000; // command register data, sends the last conversion again
+    constexpr int CHANNELS = NUM_CELLS + 8 + 1;   // cells 1 - 16, aux 0 - 7, module voltage
+
+    struct EmulDevice
+    {
+        uint8_t address;
+        uint8_t regs[256];           // multi byte registers MS byte first, the way they come off the wire
+        int32_t cells[NUM_CELLS];    // 0.1mV, a cell runs down while its balance switch is on
+        uint16_t readings[CHANNELS]; // raw ADC of the last conversion
+        int64_t convertedUs;         // uptime of the last conversion
+        uint16_t faults[3];          // responses left for each PL455EmulFault
+    };
+
+    struct Command
+    {
+        uint8_t frame[PL455_MAX_COMMAND_FRAME];
+        uint8_t length;
+    };
+
+    const struct device *const uart = DEVICE_DT_GET(EMUL_UART_NODE);
+    constexpr uint32_t NORMAL_BAUD = DT_PROP(EMUL_UART_NODE, current_speed);
+
+    EmulDevice chain[PL455_EMUL_DEVICES]; // chain position 0 is the one wired to the UART
+    bool autoAddressing = false;
+    uint16_t auxReading = 0;              // what a thermistor at 25C reads
+
+    // command frame being received, only touched from the UART callback
+    uint8_t incoming[PL455_MAX_COMMAND_FRAME];
+    uint8_t incomingLength = 0;
+    uint8_t incomingExpected = 0;
+} // anonymous namespace
+
+K_MSGQ_DEFINE(commands, sizeof(Command), PL455_LINK_QUEUE_DEPTH, 4);
+
+namespace {
+
+    uint32_t wireUs(int bytes)
+    {
+        // start bit, 8 data bits, stop bit
+        struct uart_config config;
+        uint32_t baud = (uart_config_get(uart, &config) == 0) ? config.baudrate : NORMAL_BAUD;
+        return uint32_t((uint64_t(bytes) * 10 * 1000000) / baud);
+    }
+
+    bool takeFault(EmulDevice &device, PL455EmulFault fault)
+    {
+        uint16_t &left = device.faults[int(fault)];
+        if (left == 0)
+        {
+            return false;
+        }
+        if (left != PL455_EMUL_FOREVER)
+        {
+            left--;
+        }
+        return true;
+    }
+
+    void respond(EmulDevice &device, const uint8_t *data, uint8_t size)
+    {
+        if (takeFault(device, PL455EmulFault::Silent))
+        {
+            return;
+        }
+        uint8_t frame[PL455_MAX_FRAME];
+        int length = 0;
+        frame[length++] = size - 1; // response: bit 7 clear, data bytes - 1
+        memcpy(frame + length, data, size);
+        length += size;
+        uint16_t crc = CRC16(frame, length);
+        frame[length++] = crc & 0x00FF;
+        frame[length++] = crc >> 8;
+
+        k_sleep(K_USEC(wireUs(length)));
+        if (takeFault(device, PL455EmulFault::BadCrc))
+        {
+            frame[length - 1] ^= 0xFF;
+        }
+        if (takeFault(device, PL455EmulFault::DropByte))
+        {
+            memmove(frame + length / 2, frame + length / 2 + 1, length - length / 2 - 1);
+            length--;
+        }
+        uart_emul_put_rx_data(uart, frame, length);
+    }
+
+    EmulDevice *findDevice(uint8_t address)
+    {
+        for (EmulDevice &device : chain)
+        {
+            if (device.address == address)
+            {
+                return &device;
+            }
+        }
+        return NULL;
+    }
+
+    // devices that answer a single, group or broadcast request, highest address first
+    int responders(uint8_t scope, uint8_t target, uint8_t maxAddress, EmulDevice **list)
+    {
+        int count = 0;
+        if (scope == SCOPE_SINGLE)
+        {
+            EmulDevice *device = findDevice(target);
+            if (device)
+            {
+                list[count++] = device;
+            }
+            return count;
+        }
+        // group IDs aren't modelled, a group request reaches every device like a broadcast
+        for (int address = MIN(maxAddress, 15); address >= 0; address--)
+        {
+            EmulDevice *device = findDevice(address);
+            if (device)
+            {
+                list[count++] = device;
+            }
+        }
+        return count;
+    }
+
+    int noise()
+    {
+        return int(sys_rand32_get() % 5) - 2; // +-2 counts, about 0.15mV on a cell
+    }
+
+    void convert(EmulDevice &device)
+    {
+        // register 0x14 is the balance mask, bit n = cell n + 1
+        uint16_t balance = (device.regs[0x14] << 8) | device.regs[0x15];
+        int64_t total = 0;
+        for (int cell = 0; cell < NUM_CELLS; cell++)
+        {
+            bool balancing = (balance >> cell) & 1;
+            if (balancing)
+            {
+                device.cells[cell] -= PL455_EMUL_BALANCE_DRIFT;
+            }
+            // the bleed current drops a little across the sense lines while the switch is on
+            int32_t measured = device.cells[cell] - (balancing ? PL455_EMUL_BALANCE_DROP : 0);
+            device.readings[cell] = CLAMP(int((int64_t(measured) * 65535) / 50000) + noise(), 0, 65535);
+            total += device.cells[cell];
+        }
+        for (int aux = 0; aux < 7; aux++)
+        {
+            device.readings[NUM_CELLS + aux] = auxReading + noise();
+        }
+        device.readings[NUM_CELLS + 7] = 25000 + noise(); // current shunt, no current
+        device.readings[NUM_CELLS + 8] = CLAMP((total / 100) * 65535 / 12500, 0, 65535); // 0.01V, like getModuleVoltage()
+        device.convertedUs = k_ticks_to_us_floor64(k_uptime_ticks());
+    }
+
+    void sendReadings(EmulDevice &device)
+    {
+        // the channels selected in register 0x03: cells 16 to 1, aux 7 to 0, then the module voltage
+        uint32_t select = (device.regs[0x03] << 24) | (device.regs[0x04] << 16) | (device.regs[0x05] << 8) |
+                          device.regs[0x06];
+        uint8_t data[2 * CHANNELS];
+        uint8_t size = 0;
+        auto add = [&](uint16_t reading) {
+            data[size++] = reading >> 8;
+            data[size++] = reading & 0xFF;
+        };
+        for (int cell = NUM_CELLS - 1; cell >= 0; cell--)
+        {
+            if ((select >> (16 + cell)) & 1)
+            {
+                add(device.readings[cell]);
+            }
+        }
+        for (int aux = 7; aux >= 0; aux--)
+        {
+            if ((select >> (8 + aux)) & 1)
+            {
+                add(device.readings[NUM_CELLS + aux]);
+            }
+        }
+        if ((select >> 1) & 1)
+        {
+            add(device.readings[NUM_CELLS + 8]);
+        }
+        if (size != 0)
+        {
+            respond(device, data, size);
+        }
+    }
+
+    void sample(uint8_t scope, uint8_t target, uint8_t command)
+    {
+        EmulDevice *list[PL455_EMUL_DEVICES];
+        uint8_t maxAddress = (scope == SCOPE_SINGLE) ? target : (command & 0x0F);
+        int count = responders(scope, target, maxAddress, list);
+        if (count == 0)
+        {
+            return;
+        }
+        if (!(command & CMD_SEND_LAST))
+        {
+            // every device converts at once; oversampling (register 0x07, bits 2 - 0) multiplies each channel
+            int channels = __builtin_popcount((list[0]->regs[0x03] << 24) | (list[0]->regs[0x04] << 16) |
+                                              (list[0]->regs[0x05] << 8) | list[0]->regs[0x06]);
+            k_sleep(K_USEC(channels * PL455_EMUL_CHANNEL_US * (1 << (list[0]->regs[0x07] & 0b111))));
+            for (int i = 0; i < count; i++)
+            {
+                convert(*list[i]);
+            }
+        }
+        else
+        {
+            // auto-monitor (register 0x32) has been converting in the background
+            int64_t now = k_ticks_to_us_floor64(k_uptime_ticks());
+            for (int i = 0; i < count; i++)
+            {
+                if (list[i]->regs[0x32] && (now - list[i]->convertedUs) >= PL455_AM_PERIOD_US)
+                {
+                    convert(*list[i]);
+                }
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            sendReadings(*list[i]);
+        }
+    }
+
+    void read(uint8_t scope, uint8_t target, uint8_t maxAddress, uint8_t reg, uint8_t bytes)
+    {
+        EmulDevice *list[PL455_EMUL_DEVICES];
+        int count = responders(scope, target, maxAddress, list);
+        for (int i = 0; i < count; i++)
+        {
+            uint8_t data[128];
+            for (int b = 0; b < bytes; b++)
+            {
+                data[b] = list[i]->regs[uint8_t(reg + b)];
+            }
+            if (reg == 0x0A)
+            {
+                data[0] = list[i]->address;
+            }
+            respond(*list[i], data, bytes);
+        }
+    }
+
+    void write(uint8_t scope, uint8_t target, uint8_t reg, const uint8_t *data, uint8_t size)
+    {
+        if (scope == SCOPE_BRDCST && reg == 0x0C && (data[0] & 0b00001000))
+        {
+            // auto-addressing: the following address writes go to the devices in chain order
+            for (EmulDevice &device : chain)
+            {
+                device.address = NO_ADDRESS;
+            }
+            autoAddressing = true;
+            return;
+        }
+        if (scope == SCOPE_BRDCST && reg == 0x0A && autoAddressing)
+        {
+            EmulDevice *next = findDevice(NO_ADDRESS);
+            if (next)
+            {
+                next->address = data[0];
+            }
+            return;
+        }
+        for (EmulDevice &device : chain)
+        {
+            if ((scope == SCOPE_SINGLE) && (device.address != target))
+            {
+                continue;
+            }
+            for (int i = 0; i < size; i++)
+            {
+                device.regs[uint8_t(reg + i)] = data[i];
+            }
+        }
+    }
+
+    void execute(const Command &command)
+    {
+        const uint8_t *frame = command.frame;
+        uint8_t type = (frame[0] >> 4) & 0b111;
+        uint8_t scope = type >> 1;
+        bool response = !(type & 1);
+        uint8_t size = frame[0] & 0b111;
+        size = (size == 7) ? 8 : size;
+        int pos = 1;
+        uint8_t target = (scope != SCOPE_BRDCST) ? frame[pos++] : 0;
+        pos += ADDR_SIZE;
+        uint8_t reg = frame[pos++];
+        bool groupRead = response && (scope != SCOPE_SINGLE) && (reg != 0x02);
+        uint8_t maxAddress = groupRead ? frame[pos++] : 0;
+        const uint8_t *data = frame + pos;
+
+        k_sleep(K_USEC(wireUs(command.length)));
+        if (!response)
+        {
+            write(scope, target, reg, data, size);
+        }
+        else if (reg == 0x02)
+        {
+            sample(scope, target, data[0]);
+        }
+        else
+        {
+            read(scope, target, maxAddress, reg, data[size - 1] + 1);
+        }
+    }
+
+    void receive(uint8_t data, uint32_t baud)
+    {
+        if ((baud < NORMAL_BAUD / 2) && (data == 0))
+        {
+            // TX held low for a whole slow byte - a comms break or reset, both drop a partial frame
+            incomingLength = 0;
+            LOG_DBG("emul: comms %s\n", ((9 * 1000000) / baud >= 200) ? "reset" : "break");
+            return;
+        }
+        if (incomingLength == 0 && !(data & 0b10000000))
+        {
+            return; // not a command frame
+        }
+        incoming[incomingLength++] = data;
+        if (incomingLength == 1)
+        {
+            // the header length is known from the init byte, the rest once the register is in
+            incomingExpected = 1 + (((data >> 5) & 0b11) != SCOPE_BRDCST) + 1 + ADDR_SIZE;
+            return;
+        }
+        if (incomingLength == incomingExpected && incomingExpected <= 4)
+        {
+            uint8_t init = incoming[0];
+            uint8_t type = (init >> 4) & 0b111;
+            uint8_t size = init & 0b111;
+            size = (size == 7) ? 8 : size;
+            // a group or broadcast read carries the highest address to answer ahead of its data,
+            // outside of the size field (the way PL455Link builds it)
+            bool groupRead = !(type & 1) && ((type >> 1) != SCOPE_SINGLE) && (data != 0x02);
+            incomingExpected += (groupRead ? 1 : 0) + size + 2;
+            return;
+        }
+        if (incomingLength < incomingExpected)
+        {
+            return;
+        }
+
+        Command command;
+        memcpy(command.frame, incoming, incomingLength);
+        command.length = incomingLength;
+        incomingLength = 0;
+        if (CRC16(command.frame, command.length) != 0)
+        {
+            LOG_DBG("emul: command with bad CRC dropped\n");
+            return;
+        }
+        if (k_msgq_put(&commands, &command, K_NO_WAIT) != 0)
+        {
+            LOG_WRN("emul: command queue full\n");
+        }
+    }
+
+    void onTxData(const struct device *dev, size_t size, void *user_data)
+    {
+        struct uart_config config;
+        uint32_t baud = (uart_config_get(dev, &config) == 0) ? config.baudrate : NORMAL_BAUD;
+        uint8_t data[32];
+        uint32_t count;
+        while ((count = uart_emul_get_tx_data(dev, data, sizeof(data))) > 0)
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                receive(data[i], baud);
+            }
+        }
+    }
+
+    void run(void *, void *, void *)
+    {
+        Command command;
+        while (1)
+        {
+            k_msgq_get(&commands, &command, K_FOREVER);
+            execute(command);
+        }
+    }
+
+} // anonymous namespace
+
+K_THREAD_DEFINE(pl455_emul, PL455_EMUL_STACK_SIZE, run, NULL, NULL, NULL, PL455_EMUL_PRIORITY, 0, 0);
+
+namespace {
+    int attach()
+    {
+        // a thermistor at 25C, from the same beta model the driver's table uses
+        double R = NTC_R0 * exp(NTC_BETA * (1 / 298.15 - 1.0 / NTC_T0));
+        auxReading = uint16_t(65535 * R / (R + NTC_RFIX));
+
+        for (int position = 0; position < PL455_EMUL_DEVICES; position++)
+        {
+            EmulDevice &device = chain[position];
+            memset(&device, 0, sizeof(device));
+            device.address = NO_ADDRESS;
+            for (int cell = 0; cell < NUM_CELLS; cell++)
+            {
+                // a few tens of mV apart, so there's something to balance
+                device.cells[cell] = PL455_EMUL_CELL_MV * 10 + ((position * 7 + cell * 13) % 40) * 10;
+            }
+            convert(device);
+        }
+        uart_emul_callback_tx_data_ready_set(uart, onTxData, NULL);
+        LOG_INF("PL455 emulator: %d devices on %s\n", PL455_EMUL_DEVICES, uart->name);
+        return 0;
+    }
+} // anonymous namespace
+
+void PL455EmulInject(PL455EmulFault fault, uint8_t device, uint16_t count)
+{
+    if (device < PL455_EMUL_DEVICES)
+    {
+        chain[device].faults[int(fault)] = count;
+    }
+}
+
+// before main() builds the chains, so their first frames already reach the model
+SYS_INIT(attach, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+
+namespace {
+    int cmdFault(const struct shell *sh, size_t argc, char **argv)
+    {
+        static const char *const names[] = {"drop", "crc", "silent"};
+        for (unsigned int fault = 0; fault < ARRAY_SIZE(names); fault++)
+        {
+            if (strcmp(argv[1], names[fault]) == 0)
+            {
+                uint16_t count = (argc > 3) ? uint16_t(atoi(argv[3])) : PL455_EMUL_FOREVER;
+                PL455EmulInject(PL455EmulFault(fault), atoi(argv[2]), count);
+                return 0;
+            }
+        }
+        shell_error(sh, "fault is drop, crc or silent");
+        return -EINVAL;
+    }
+} // anonymous namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(pl455EmulCommands,
+    SHELL_CMD_ARG(fault, NULL, "Inject a fault: <drop|crc|silent> <chain position> [responses, 0 clears, default forever]", cmdFault, 3, 1),
+    SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(pl455emul, &pl455EmulCommands, "Emulated PL455 chain", NULL);
+#endif
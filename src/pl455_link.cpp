@@ -0,0 +1,369 @@
+#include "pl455_link.h"
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+PL455Link::PL455Link(PL455Uart &uart) : mUart(uart)
+{
+    k_msgq_init(&queue, queueBuffer, sizeof(PL455Transaction), PL455_LINK_QUEUE_DEPTH);
+
+    k_tid_t tid = k_thread_create(&thread, stack, K_KERNEL_STACK_SIZEOF(stack),
+                                  threadEntry, this, NULL, NULL,
+                                  PL455_LINK_PRIORITY, 0, K_NO_WAIT);
+    if (!tid)
+    {
+        LOG_ERR("ERROR spawning PL455 link thread\n");
+        return;
+    }
+    k_thread_name_set(tid, "pl455_link");
+}
+
+int PL455Link::submit(const PL455Transaction &transaction, k_timeout_t wait)
+{
+    int ret = k_msgq_put(&queue, &transaction, wait);
+    if (ret != 0)
+    {
+        LOG_ERR("ERROR: PL455 transaction queue full!\n");
+    }
+    return ret;
+}
+
+namespace {
+    struct TransferResult
+    {
+        struct k_sem done;
+        uint8_t *response;
+        int size;
+        int status;
+    };
+
+    void onTransferComplete(void *context, int status, uint8_t index, const uint8_t *response, int length)
+    {
+        TransferResult *result = static_cast<TransferResult *>(context);
+        if (status < 0)
+        {
+            result->status = status;
+        }
+        else if (length > result->size)
+        {
+            result->status = -ENOMEM;
+        }
+        else
+        {
+            memcpy(result->response, response, length);
+            result->status = length;
+        }
+        k_sem_give(&result->done);
+    }
+} // anonymous namespace
+
+int PL455Link::transfer(PL455Transaction transaction, uint8_t *response, int size)
+{
+    TransferResult result;
+    k_sem_init(&result.done, 0, 1);
+    result.response = response;
+    result.size = size;
+    result.status = -EIO;
+
+    transaction.callback = onTransferComplete;
+    transaction.context = &result;
+    int ret = submit(transaction);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    k_sem_take(&result.done, K_FOREVER); // the link always completes, at worst by timing out
+    return result.status;
+}
+
+int PL455Link::write(uint8_t scope, uint8_t device_addr, uint8_t register_addr, const uint8_t *data, uint8_t data_size)
+{
+    if (data_size > sizeof(PL455Transaction::data))
+    {
+        return -EINVAL;
+    }
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Write;
+    transaction.scope = scope;
+    transaction.device = device_addr;
+    transaction.reg = register_addr;
+    transaction.dataSize = data_size;
+    memcpy(transaction.data, data, data_size);
+    return submit(transaction);
+}
+
+int PL455Link::writeFrame(const uint8_t *frame, uint8_t size)
+{
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Write;
+    transaction.frame = frame;
+    transaction.frameSize = size;
+    return submit(transaction);
+}
+
+int PL455Link::sendBreak(PL455Op op)
+{
+    PL455Transaction transaction = {};
+    transaction.op = op;
+    return submit(transaction);
+}
+
+PL455LinkStats PL455Link::getStats()
+{
+    unsigned int key = irq_lock();
+    PL455LinkStats copy = stats;
+    irq_unlock(key);
+    return copy;
+}
+
+int PL455Link::read(uint8_t scope, uint8_t device_addr, uint8_t group_id, uint8_t register_addr, uint8_t bytesToReturn, uint8_t *response, int size)
+{
+    PL455Transaction transaction = {};
+    transaction.op = PL455Op::Read;
+    transaction.scope = scope;
+    transaction.device = device_addr;
+    transaction.group = group_id;
+    transaction.reg = register_addr;
+    transaction.dataSize = 1;
+    transaction.data[0] = bytesToReturn - 1;
+    transaction.responses = 1;
+    transaction.responseSize = bytesToReturn + 3;
+    transaction.timeout = COMM_TIMEOUT;
+    return transfer(transaction, response, size);
+}
+
+void PL455Link::threadEntry(void *link, void *, void *)
+{
+    static_cast<PL455Link *>(link)->run();
+}
+
+void PL455Link::run()
+{
+    uint8_t response[PL455_MAX_FRAME];
+    struct k_poll_event events[2];
+
+    k_poll_event_init(&events[0], K_POLL_TYPE_SEM_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY, mUart.rxSignal());
+    k_poll_event_init(&events[1], K_POLL_TYPE_MSGQ_DATA_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY, &queue);
+
+    while (1)
+    {
+        startQueued();
+
+        k_timeout_t wait = K_FOREVER;
+        if (inFlightCount != 0)
+        {
+            int64_t left = inFlight[inFlightHead].deadline - k_uptime_get();
+            wait = K_MSEC(MAX(left, 0));
+        }
+
+        // only wake for new transactions if there is room to start them
+        int numEvents = (inFlightCount < PL455_MAX_OUTSTANDING) ? 2 : 1;
+        events[0].state = K_POLL_STATE_NOT_READY;
+        events[1].state = K_POLL_STATE_NOT_READY;
+        k_poll(events, numEvents, wait);
+
+        int length;
+        while ((length = mUart.receive(response, sizeof(response), K_NO_WAIT)) > 0)
+        {
+            deliver(response, length);
+        }
+        expire();
+    }
+}
+
+void PL455Link::startQueued()
+{
+    PL455Transaction transaction;
+    while ((inFlightCount < PL455_MAX_OUTSTANDING) && (k_msgq_get(&queue, &transaction, K_NO_WAIT) == 0))
+    {
+        if (send(transaction) != 0)
+        {
+            // never went out - nothing will answer it, and it didn't succeed either
+            if (transaction.callback)
+            {
+                transaction.callback(transaction.context, -EINVAL, 0, NULL, 0);
+            }
+            continue;
+        }
+        if (transaction.op == PL455Op::Write || transaction.op == PL455Op::Break || transaction.op == PL455Op::Reset ||
+            transaction.responses == 0)
+        {
+            // nothing will come back - done as soon as it is on its way
+            if (transaction.callback)
+            {
+                transaction.callback(transaction.context, 0, 0, NULL, 0);
+            }
+            continue;
+        }
+        InFlight &slot = inFlight[(inFlightHead + inFlightCount) % PL455_MAX_OUTSTANDING];
+        slot.transaction = transaction;
+        slot.received = 0;
+        // only counts at the head, popHead() starts it again for the next one - a short request queued
+        // behind a long scan would otherwise time out while the chain is still busy answering the scan
+        slot.deadline = k_uptime_get() + transaction.timeout;
+        inFlightCount++;
+    }
+}
+
+void PL455Link::deliver(const uint8_t *response, int length)
+{
+    if (inFlightCount == 0)
+    {
+        // if we're not looking for a response, this is definately noise.
+        LOG_DBG("unexpected response dropped\n");
+        return;
+    }
+
+    InFlight &current = inFlight[inFlightHead];
+    const PL455Transaction &transaction = current.transaction;
+    if ((transaction.responseSize != 0) && (length != transaction.responseSize))
+    {
+        // responses are matched by position only - once one is missing (dropped on a bad CRC) or
+        // foreign, everything behind it would land one request off
+        LOG_ERR("ERROR: %d byte response on register 0x%02x, expected %d!\n", length, transaction.reg,
+                transaction.responseSize);
+        resync();
+        return;
+    }
+    lastCrcErrors = mUart.getStats().crcErrors; // anything failing from here on is a response still owed
+    uint8_t index = current.received++;
+    if (transaction.callback)
+    {
+        transaction.callback(transaction.context, 0, index, response, length);
+    }
+    if (current.received == transaction.responses)
+    {
+        popHead();
+    }
+}
+
+void PL455Link::resync()
+{
+    // fail everything in flight and drop what the chain still has on its way
+    while (inFlightCount != 0)
+    {
+        InFlight &current = inFlight[inFlightHead];
+        if (current.transaction.callback)
+        {
+            current.transaction.callback(current.transaction.context, -EBADMSG, current.received, NULL, 0);
+        }
+        inFlightHead = (inFlightHead + 1) % PL455_MAX_OUTSTANDING;
+        inFlightCount--;
+    }
+    mUart.flush();
+}
+
+void PL455Link::popHead()
+{
+    inFlightHead = (inFlightHead + 1) % PL455_MAX_OUTSTANDING;
+    inFlightCount--;
+    if (inFlightCount != 0)
+    {
+        InFlight &next = inFlight[inFlightHead];
+        next.deadline = k_uptime_get() + next.transaction.timeout;
+    }
+}
+
+void PL455Link::expire()
+{
+    int64_t now = k_uptime_get();
+    while ((inFlightCount != 0) && (now >= inFlight[inFlightHead].deadline))
+    {
+        InFlight &current = inFlight[inFlightHead];
+        PL455Transaction &transaction = current.transaction;
+        LOG_ERR("ERROR: comms timeout on register 0x%02x, device %d!\n", transaction.reg, transaction.device);
+        countTimeout(current);
+        if ((transaction.retries != 0) && (inFlightCount == 1))
+        {
+            // nothing behind it whose responses could get mixed up - ask again from scratch
+            transaction.retries--;
+            stats.retries++;
+            mUart.flush();
+            send(transaction);
+            current.received = 0;
+            current.deadline = k_uptime_get() + transaction.timeout;
+            continue;
+        }
+        if (transaction.callback)
+        {
+            transaction.callback(transaction.context, -ETIMEDOUT, current.received, NULL, 0);
+        }
+        popHead();
+        // anything arriving late belongs to the request we just gave up on
+        if (inFlightCount == 0)
+        {
+            mUart.flush();
+        }
+    }
+}
+
+void PL455Link::countTimeout(const InFlight &timedOut)
+{
+    // group responses come back highest address first, so the silent device is the next one down
+    const PL455Transaction &transaction = timedOut.transaction;
+    int device = (transaction.responses > 1) ? (transaction.device - timedOut.received) : transaction.device;
+    uint32_t crcErrors = mUart.getStats().crcErrors;
+
+    unsigned int key = irq_lock();
+    if ((device >= 0) && (device < MAX_MODULES))
+    {
+        stats.timeouts[device]++;
+        if (crcErrors != lastCrcErrors)
+        {
+            stats.crcErrors[device]++;
+        }
+    }
+    irq_unlock(key);
+    lastCrcErrors = crcErrors;
+}
+
+int PL455Link::send(const PL455Transaction &transaction)
+{
+    if (transaction.op == PL455Op::Break || transaction.op == PL455Op::Reset)
+    {
+        bool reset = (transaction.op == PL455Op::Reset);
+        mUart.sendBreak(reset ? PL455_RESET_US : PL455_BREAK_US);
+        unsigned int key = irq_lock();
+        if (reset)
+        {
+            stats.resets++;
+        }
+        else
+        {
+            stats.breaks++;
+        }
+        irq_unlock(key);
+        return 0;
+    }
+
+    if (transaction.frame)
+    {
+        // prebuilt, nothing left to do
+        mUart.send(transaction.frame, transaction.frameSize);
+        return 0;
+    }
+
+    bool noResponse = (transaction.op == PL455Op::Write);
+    bool groupRead = (transaction.op == PL455Op::Read) && (transaction.scope != SCOPE_SINGLE);
+    uint8_t dataSize = (transaction.op == PL455Op::Read) ? 1 : transaction.dataSize;
+    if (!PL455ValidDataSize(dataSize))
+    {
+        // doesn't accept 7 uint8_ts, or more than 8 uint8_ts of data
+        LOG_ERR("ERROR: cannot write with %d bytes!\n", dataSize);
+        return -EINVAL;
+    }
+
+    uint8_t frame[PL455_MAX_COMMAND_FRAME];
+    PL455FrameBuilder builder(frame);
+    builder.header(noResponse, transaction.scope, dataSize,
+                   (transaction.scope == SCOPE_GROUP) ? transaction.group : transaction.device, transaction.reg);
+    if (groupRead)
+    {
+        builder.byte(transaction.device); // max device address to respond
+    }
+    builder.data(transaction.data, transaction.dataSize);
+    int frameSize = builder.finish();
+    LOG_HEXDUMP_DBG(frame, frameSize, "Sending");
+    mUart.send(frame, frameSize);
+    return 0;
+}
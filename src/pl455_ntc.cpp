@@ -0,0 +1,124 @@
+#include "pl455_ntc.h"
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <math.h>
+#include <stdlib.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+#define NTC_TABLE_SHIFT 7 // ADC counts between table points, as a power of 2
+#define NTC_TABLE_SIZE ((65536 >> NTC_TABLE_SHIFT) + 1)
+#define NTC_TEMP_MIN -550 // 0.1C, the table saturates here - well outside the sensors' range
+#define NTC_TEMP_MAX 1550
+
+namespace {
+    // natural log for the table generator, ln(m * 2^k) = 2 * atanh((m - 1) / (m + 1)) + k * ln(2)
+    constexpr double ConstLn(double x)
+    {
+        int k = 0;
+        while (x > 2)
+        {
+            x /= 2;
+            k++;
+        }
+        while (x < 1)
+        {
+            x *= 2;
+            k--;
+        }
+        double y = (x - 1) / (x + 1);
+        double term = y;
+        double sum = 0;
+        for (int n = 1; n < 40; n += 2)
+        {
+            sum += term / n;
+            term *= y * y;
+        }
+        return 2 * sum + k * 0.69314718055994531;
+    }
+
+    // same beta equation as the float version, in 0.1C
+    constexpr int16_t TableEntry(int index)
+    {
+        double adc = double(index << NTC_TABLE_SHIFT);
+        // the ends of the scale are a short or an open sensor - keep them finite
+        adc = (adc < 1) ? 1 : ((adc > 65534) ? 65534 : adc);
+        double R = (adc * NTC_RFIX) / (65535 - adc);
+        double invTemp = (1.0 / NTC_T0) + (1.0 / NTC_BETA) * ConstLn(R / NTC_R0);
+        double temperature = ((1 / invTemp) - 273) * 10;
+        temperature = (temperature < NTC_TEMP_MIN) ? NTC_TEMP_MIN : ((temperature > NTC_TEMP_MAX) ? NTC_TEMP_MAX : temperature);
+        return int16_t(temperature < 0 ? temperature - 0.5 : temperature + 0.5);
+    }
+
+    struct NTCTable
+    {
+        int16_t entries[NTC_TABLE_SIZE];
+    };
+
+    constexpr NTCTable MakeTable()
+    {
+        NTCTable table = {};
+        for (int i = 0; i < NTC_TABLE_SIZE; i++)
+        {
+            table.entries[i] = TableEntry(i);
+        }
+        return table;
+    }
+
+    constexpr NTCTable ntc_table = MakeTable(); // lives in flash
+} // anonymous namespace
+
+int16_t NTCTemperature(uint16_t adcReading)
+{
+    uint16_t index = adcReading >> NTC_TABLE_SHIFT;
+    int32_t fraction = adcReading & ((1 << NTC_TABLE_SHIFT) - 1);
+    int32_t low = ntc_table.entries[index];
+    int32_t high = ntc_table.entries[index + 1];
+    return int16_t(low + (((high - low) * fraction) >> NTC_TABLE_SHIFT));
+}
+
+#if PL455_NTC_BENCHMARK
+namespace {
+    // the runtime float beta equation this table replaces
+    int16_t NTCTemperatureFloat(uint16_t adcReading)
+    {
+        const float To = NTC_T0;
+        const float Ro = NTC_R0;
+        const float Rfix = NTC_RFIX;
+        const float B = NTC_BETA;
+        float R = (adcReading * Rfix) / (65535 - adcReading);
+        float invTemp = (1 / To) + (1 / B) * logf(R / Ro);
+        float temperature = (1 / invTemp) - 273;
+        return int16_t(temperature * 10);
+    }
+
+    // cycles per conversion x100, over readings from about -40C to 125C
+    uint32_t benchmark(int16_t (*convert)(uint16_t), volatile int16_t *sink)
+    {
+        const int conversions = 1024;
+        unsigned int key = irq_lock();
+        uint32_t start = k_cycle_get_32();
+        for (int i = 0; i < conversions; i++)
+        {
+            *sink = convert(4096 + i * 56);
+        }
+        uint32_t cycles = k_cycle_get_32() - start;
+        irq_unlock(key);
+        return (uint32_t)(((uint64_t)cycles * 100) / conversions);
+    }
+} // anonymous namespace
+
+void NTCBenchmark()
+{
+    volatile int16_t sink;
+    uint32_t floatCycles = benchmark(NTCTemperatureFloat, &sink);
+    uint32_t tableCycles = benchmark(NTCTemperature, &sink);
+    int worst = 0;
+    for (uint32_t adc = 4096; adc < 61440; adc++)
+    {
+        worst = MAX(worst, abs(NTCTemperatureFloat(adc) - NTCTemperature(adc)));
+    }
+    LOG_INF("NTC cycles/conversion x100: float %u, table %u, worst difference %d (0.1C)\n",
+            floatCycles, tableCycles, worst);
+}
+#endif
@@ -0,0 +1,234 @@
+#include "pl455_pack.h"
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+#if !DT_NODE_HAS_STATUS_OKAY(BQUART_NODE)
+#error "BOARD does not define bquart"
+#endif
+
+#define BQWAKEUP_NODE DT_ALIAS(bqwakeup)
+#if !DT_NODE_HAS_STATUS_OKAY(BQWAKEUP_NODE)
+#error "BOARD does not define bqwakeup"
+#endif
+
+// wakeup pin of chain n, falling back to the shared one
+#define BQWAKEUP_SPEC(n) \
+    GPIO_DT_SPEC_GET(COND_CODE_1(DT_NODE_HAS_STATUS_OKAY(DT_ALIAS(bqwakeup##n)), (DT_ALIAS(bqwakeup##n)), (BQWAKEUP_NODE)), gpios)
+
+// FAULT line of a chain (bqfault, bqfault1, ...), left empty if the board doesn't wire one
+#define BQFAULT_SPEC(alias) GPIO_DT_SPEC_GET_OR(DT_ALIAS(alias), gpios, {0})
+
+namespace {
+    const struct gpio_dt_spec wakeup0 = GPIO_DT_SPEC_GET(BQWAKEUP_NODE, gpios);
+    const struct gpio_dt_spec fault0 = BQFAULT_SPEC(bqfault);
+#if DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE)
+    const struct gpio_dt_spec wakeup1 = BQWAKEUP_SPEC(1);
+    const struct gpio_dt_spec fault1 = BQFAULT_SPEC(bqfault1);
+#endif
+#if DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE)
+    const struct gpio_dt_spec wakeup2 = BQWAKEUP_SPEC(2);
+    const struct gpio_dt_spec fault2 = BQFAULT_SPEC(bqfault2);
+#endif
+} // anonymous namespace
+
+PL455Pack::PL455Pack(GPIO &gpio, PL455PackFaultCallback faultCallback, void *faultContext)
+    : mChain0(gpio, 0, DEVICE_DT_GET(BQUART_NODE), wakeup0, &fault0)
+#if DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE)
+    , mChain1(gpio, 1, DEVICE_DT_GET(BQUART1_NODE), wakeup1, &fault1)
+#endif
+#if DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE)
+    , mChain2(gpio, 2, DEVICE_DT_GET(BQUART2_NODE), wakeup2, &fault2)
+#endif
+    , mChains{&mChain0
+#if DT_NODE_HAS_STATUS_OKAY(BQUART1_NODE)
+    , &mChain1
+#endif
+#if DT_NODE_HAS_STATUS_OKAY(BQUART2_NODE)
+    , &mChain2
+#endif
+    }
+    , faultCallback(faultCallback)
+    , faultContext(faultContext)
+{
+    k_mutex_init(&captureLock);
+    k_mutex_init(&chainLock);
+
+    for (PL455 *chain : mChains)
+    {
+        chain->setFaultCallback(onChainFault, this);
+        chain->setActivityCallback(onChainActivity, this);
+        chain->init();
+    }
+
+    // same first deadline for every chain - from here on they step together
+    int64_t start = k_uptime_ticks();
+    for (PL455 *chain : mChains)
+    {
+        chain->start(start);
+    }
+    LOG_INF("%d PL455 chain(s) running\n", PL455_NUM_CHAINS);
+#ifdef CONFIG_SHELL
+    PL455ShellAttach(*this);
+#endif
+}
+
+void PL455Pack::fillModuleData(ModuleData &moduleData)
+{
+    uint8_t slot = 0;
+    moduleData.cellStatesUpdateFlags.clear();
+    moduleData.adcUpdateFlags.clear();
+    moduleData.temperatureUpdateFlags.clear();
+    moduleData.moduleState.m1Voltage = 0;
+    moduleData.moduleState.m2Voltage = 0;
+    moduleData.moduleState.current = 0; // stays 0 while the first chain's first device is lost
+    for (PL455 *chain : mChains)
+    {
+        chain->fillModuleData(moduleData, slot);
+        slot += chain->getMaxDevices();
+    }
+
+    int16_t hottest = INT16_MIN;
+    for (int sensor = 0; sensor < ModuleData::auxes; sensor++)
+    {
+        if (moduleData.temperatureUpdateFlags.test(sensor))
+        {
+            hottest = MAX(hottest, moduleData.temperatures[sensor]);
+        }
+    }
+    moduleData.moduleState.temperature = (hottest == INT16_MIN) ? 250 : hottest; // 25*C without any sensors
+}
+
+uint8_t PL455Pack::getFirstSlot(int chain)
+{
+    uint8_t slot = 0;
+    for (int i = 0; i < chain; i++)
+    {
+        slot += mChains[i]->getMaxDevices();
+    }
+    return slot;
+}
+
+void PL455Pack::setOversampling(PL455Oversampling profile)
+{
+    for (PL455 *chain : mChains)
+    {
+        chain->setOversampling(profile);
+    }
+}
+
+int PL455Pack::startCapture(uint8_t chain, const PL455CaptureRequest &request, bool triggerOnCurrent)
+{
+    if (chain >= PL455_NUM_CHAINS)
+    {
+        return -EINVAL;
+    }
+    k_mutex_lock(&captureLock, K_FOREVER);
+    if ((captureChain >= 0) && (captureChain != chain) &&
+        (mChains[captureChain]->getCaptureInfo().state == PL455CaptureState::Running))
+    {
+        k_mutex_unlock(&captureLock);
+        return -EBUSY;
+    }
+    if ((captureChain >= 0) && (captureChain != chain))
+    {
+        mChains[captureChain]->cancelCapture(); // disarm, the buffer is about to move
+    }
+    int ret = mChains[chain]->startCapture(request, captureBuffer, PL455_CAPTURE_WORDS, triggerOnCurrent);
+    if (ret == 0)
+    {
+        captureChain = chain;
+    }
+    k_mutex_unlock(&captureLock);
+    return ret;
+}
+
+void PL455Pack::cancelCapture()
+{
+    k_mutex_lock(&captureLock, K_FOREVER);
+    if (captureChain >= 0)
+    {
+        mChains[captureChain]->cancelCapture();
+    }
+    k_mutex_unlock(&captureLock);
+}
+
+int PL455Pack::readCapture(uint32_t offset, uint16_t *words, uint32_t count)
+{
+    k_mutex_lock(&captureLock, K_FOREVER);
+    int copied = 0;
+    if (captureChain >= 0)
+    {
+        PL455CaptureInfo info = mChains[captureChain]->getCaptureInfo();
+        uint32_t used = uint32_t(info.records) * info.recordWords;
+        if ((info.state == PL455CaptureState::Done) && (offset < used))
+        {
+            copied = MIN(count, used - offset);
+            memcpy(words, captureBuffer + offset, copied * sizeof(uint16_t));
+        }
+    }
+    k_mutex_unlock(&captureLock);
+    return copied;
+}
+
+void PL455Pack::onChainFault(void *context, uint8_t chain, uint8_t flags)
+{
+    // every chain calls this from its own work queue
+    PL455Pack *self = static_cast<PL455Pack *>(context);
+    k_mutex_lock(&self->chainLock, K_FOREVER);
+    self->chainFaults[chain] = flags;
+    uint8_t combined = 0;
+    for (uint8_t chainFlags : self->chainFaults)
+    {
+        combined |= chainFlags;
+    }
+    if (self->faultCallback)
+    {
+        self->faultCallback(self->faultContext, combined);
+    }
+    k_mutex_unlock(&self->chainLock);
+}
+
+void PL455Pack::onChainActivity(void *context, uint8_t chain, PL455Activity chainActivity)
+{
+    // the busiest chain sets the rate for all of them. Speeding up is immediate, slowing down
+    // waits for RATE_RELAX_MS of calm so the rate doesn't flap around a threshold.
+    PL455Pack *self = static_cast<PL455Pack *>(context);
+    k_mutex_lock(&self->chainLock, K_FOREVER);
+    self->chainActivity[chain] = chainActivity;
+    PL455Activity wanted = PL455Activity::Rest;
+    for (PL455Activity level : self->chainActivity)
+    {
+        wanted = MAX(wanted, level);
+    }
+
+    int64_t now = k_uptime_get();
+    if (wanted >= self->activity)
+    {
+        self->calmSinceMs = now;
+        if (wanted == self->activity)
+        {
+            k_mutex_unlock(&self->chainLock);
+            return;
+        }
+    }
+    else if ((now - self->calmSinceMs) < RATE_RELAX_MS)
+    {
+        k_mutex_unlock(&self->chainLock);
+        return;
+    }
+    else
+    {
+        self->calmSinceMs = now;
+    }
+
+    self->activity = wanted;
+    static const uint32_t periods[] = {BMS_CYCLE_PERIOD_MAX, BMS_CYCLE_PERIOD, BMS_CYCLE_PERIOD_MIN};
+    self->cyclePeriodUs = periods[static_cast<int>(wanted)];
+    for (PL455 *pl455 : self->mChains)
+    {
+        pl455->setCyclePeriod(self->cyclePeriodUs);
+    }
+    LOG_INF("Acquisition period now %u ms\n", self->cyclePeriodUs / 1000);
+    k_mutex_unlock(&self->chainLock);
+}
@@ -0,0 +1,162 @@
+#include "pl455_pack.h"
+
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#include <stdlib.h>
+
+namespace {
+    PL455Pack *shellPack = NULL;
+
+    int cmdStats(const struct shell *sh, size_t argc, char **argv)
+    {
+        if (!shellPack)
+        {
+            shell_error(sh, "PL455 not running");
+            return -ENODEV;
+        }
+        for (int chain = 0; chain < shellPack->getNumChains(); chain++)
+        {
+            PL455 &pl455 = shellPack->getChain(chain);
+            PL455Health health = pl455.getHealth();
+            shell_print(sh, "chain %d: %d devices, %u frames, %u CRC errors, %u noise bytes, %u RX overflows",
+                        chain, pl455.getNumModules(), health.uart.framesReceived, health.uart.crcErrors,
+                        health.uart.noiseBytes, health.uart.rxOverflows);
+            shell_print(sh, "  %u retries, %u breaks, %u resets, %u re-inits, recovery level %d",
+                        health.link.retries, health.link.breaks, health.link.resets, health.reinits,
+                        health.recoveryLevel);
+            if (PL455_AUTOMONITOR)
+            {
+                shell_print(sh, "  auto-monitor: %u stale reads, re-armed %u times", health.staleReads,
+                            health.autoMonitorRearms);
+            }
+            for (int device = 0; device < pl455.getNumModules(); device++)
+            {
+                shell_print(sh, "  device %d: %u timeouts, %u CRC errors", device,
+                            health.link.timeouts[device], health.link.crcErrors[device]);
+            }
+        }
+        return 0;
+    }
+
+    int cmdTiming(const struct shell *sh, size_t argc, char **argv)
+    {
+        if (!shellPack)
+        {
+            shell_error(sh, "PL455 not running");
+            return -ENODEV;
+        }
+        shell_print(sh, "cycle %u us, publish every %u ms", shellPack->getCyclePeriodUs(), shellPack->getPublishPeriodMs());
+        for (int chain = 0; chain < shellPack->getNumChains(); chain++)
+        {
+            PL455 &pl455 = shellPack->getChain(chain);
+            PL455TimingStats timing = pl455.getTimingStats();
+            shell_print(sh, "chain %d: %d devices, init %u ms", chain, pl455.getNumModules(), timing.initMs);
+            if (timing.acquisitions != 0)
+            {
+                shell_print(sh, "  %u acquisitions, last %u us, max %u us, mean %u us", timing.acquisitions,
+                            timing.lastAcquisitionUs, timing.maxAcquisitionUs,
+                            uint32_t(timing.totalAcquisitionUs / timing.acquisitions));
+            }
+            if (timing.steps != 0)
+            {
+                shell_print(sh, "  %u steps, %u overruns, lateness max %lld us, mean %lld us", timing.steps,
+                            timing.overruns, timing.maxLatenessUs, timing.totalLatenessUs / timing.steps);
+            }
+        }
+        return 0;
+    }
+
+    int cmdOversampling(const struct shell *sh, size_t argc, char **argv)
+    {
+        if (!shellPack)
+        {
+            shell_error(sh, "PL455 not running");
+            return -ENODEV;
+        }
+        if (argc > 1)
+        {
+            int profile = atoi(argv[1]);
+            if (profile < 0 || profile > int(PL455Oversampling::LowNoise))
+            {
+                shell_error(sh, "profile is 0 (2x), 1 (8x) or 2 (16x)");
+                return -EINVAL;
+            }
+            shellPack->setOversampling(PL455Oversampling(profile));
+        }
+        shell_print(sh, "oversampling profile %d", int(shellPack->getChain(0).getOversampling()));
+        return 0;
+    }
+
+    int cmdCapture(const struct shell *sh, size_t argc, char **argv)
+    {
+        if (!shellPack)
+        {
+            shell_error(sh, "PL455 not running");
+            return -ENODEV;
+        }
+        PL455CaptureRequest request = {uint8_t(atoi(argv[2])), uint16_t(strtoul(argv[3], NULL, 0)),
+                                       uint8_t(strtoul(argv[4], NULL, 0)), uint16_t(atoi(argv[5]))};
+        bool onCurrent = (argc > 6) && (atoi(argv[6]) != 0);
+        int ret = shellPack->startCapture(atoi(argv[1]), request, onCurrent);
+        if (ret != 0)
+        {
+            shell_error(sh, "capture rejected: %d", ret);
+            return ret;
+        }
+        shell_print(sh, onCurrent ? "armed" : "running");
+        return 0;
+    }
+
+    int cmdDump(const struct shell *sh, size_t argc, char **argv)
+    {
+        if (!shellPack)
+        {
+            shell_error(sh, "PL455 not running");
+            return -ENODEV;
+        }
+        int chain = shellPack->getCaptureChain();
+        if (chain < 0)
+        {
+            shell_error(sh, "no capture");
+            return -ENOENT;
+        }
+        PL455CaptureInfo info = shellPack->getChain(chain).getCaptureInfo();
+        shell_print(sh, "chain %d device %d cells 0x%04x aux 0x%02x: state %d, %u records in %u us",
+                    chain, info.device, info.cellMask, info.auxMask, int(info.state), info.records, info.durationUs);
+        if (info.state != PL455CaptureState::Done)
+        {
+            return 0;
+        }
+        uint16_t record[2 + 24];
+        for (uint32_t i = 0; i < info.records; i++)
+        {
+            int words = shellPack->readCapture(i * info.recordWords, record, info.recordWords);
+            if (words != info.recordWords)
+            {
+                break;
+            }
+            shell_fprintf(sh, SHELL_NORMAL, "%u", record[0] | (uint32_t(record[1]) << 16));
+            for (int w = 2; w < words; w++)
+            {
+                shell_fprintf(sh, SHELL_NORMAL, ",%u", record[w]);
+            }
+            shell_fprintf(sh, SHELL_NORMAL, "\n");
+        }
+        return 0;
+    }
+} // anonymous namespace
+
+void PL455ShellAttach(PL455Pack &pack)
+{
+    shellPack = &pack;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(pl455Commands,
+    SHELL_CMD(stats, NULL, "Link health counters per chain and device", cmdStats),
+    SHELL_CMD(timing, NULL, "Current acquisition rate, then init time, acquisition cycle time and step lateness per chain", cmdTiming),
+    SHELL_CMD_ARG(oversampling, NULL, "Show or set the conversion profile: 0 fast, 1 normal, 2 low noise", cmdOversampling, 1, 1),
+    SHELL_CMD_ARG(capture, NULL, "Burst capture: <chain> <device> <cell mask> <aux mask> <ms> [1: on a current step]", cmdCapture, 6, 1),
+    SHELL_CMD(dump, NULL, "Print the last capture as CSV, time in us then the readings", cmdDump),
+    SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(pl455, &pl455Commands, "PL455 chains", NULL);
+#endif
@@ -0,0 +1,78 @@
+#include "pl455_topology.h"
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+#include <stdio.h>
+#include <errno.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+namespace {
+    struct LoadResult
+    {
+        PL455Topology *topology;
+        int status;
+    };
+
+    int onLoad(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+    {
+        LoadResult *result = static_cast<LoadResult *>(param);
+        if (len != sizeof(PL455Topology))
+        {
+            // written by a firmware with a different layout
+            return 0;
+        }
+        if (read_cb(cb_arg, result->topology, len) == (ssize_t)len)
+        {
+            result->status = 0;
+        }
+        return 0;
+    }
+
+    int init()
+    {
+        // safe to call more than once
+        int ret = settings_subsys_init();
+        if (ret != 0)
+        {
+            LOG_ERR("ERROR: settings storage unavailable (%d)\n", ret);
+        }
+        return ret;
+    }
+
+    void keyName(char *name, size_t size, uint8_t chain)
+    {
+        snprintf(name, size, "pl455/topo%d", chain);
+    }
+} // anonymous namespace
+
+int PL455TopologyLoad(uint8_t chain, PL455Topology &topology)
+{
+    int ret = init();
+    if (ret != 0)
+    {
+        return ret;
+    }
+    char name[16];
+    keyName(name, sizeof(name), chain);
+    LoadResult result = {&topology, -ENOENT};
+    ret = settings_load_subtree_direct(name, onLoad, &result);
+    return (ret != 0) ? ret : result.status;
+}
+
+int PL455TopologySave(uint8_t chain, const PL455Topology &topology)
+{
+    int ret = init();
+    if (ret != 0)
+    {
+        return ret;
+    }
+    char name[16];
+    keyName(name, sizeof(name), chain);
+    ret = settings_save_one(name, &topology, sizeof(topology));
+    if (ret != 0)
+    {
+        LOG_ERR("ERROR: saving chain %d topology failed (%d)\n", chain, ret);
+    }
+    return ret;
+}
@@ -0,0 +1,213 @@
+#include "pl455_uart.h"
+#include "pl455_crc.h"
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+PL455Uart::PL455Uart(const struct device *uart) : uartDev(uart)
+{
+    ring_buf_init(&txRing, sizeof(txBuffer), txBuffer);
+    ring_buf_init(&rxRing, sizeof(rxBuffer), rxBuffer);
+    k_sem_init(&txSpace, 0, 1);
+    k_sem_init(&rxFrames, 0, K_SEM_MAX_LIMIT);
+
+    if (!device_is_ready(uartDev))
+    {
+        LOG_ERR("Error: UART device not ready.\n");
+        return;
+    }
+
+    uart_irq_rx_disable(uartDev);
+    uart_irq_tx_disable(uartDev);
+    uart_irq_callback_user_data_set(uartDev, isr, this);
+
+    // drain anything left in the hardware FIFO before we start listening
+    uint8_t dummy;
+    while (uart_fifo_read(uartDev, &dummy, 1) > 0)
+    {
+    }
+    uart_irq_rx_enable(uartDev);
+}
+
+int PL455Uart::send(const uint8_t *data, int length)
+{
+    while (length > 0)
+    {
+        unsigned int key = irq_lock();
+        uint32_t queued = ring_buf_put(&txRing, data, length);
+        irq_unlock(key);
+
+        uart_irq_tx_enable(uartDev);
+        data += queued;
+        length -= queued;
+
+        if (length > 0 && k_sem_take(&txSpace, K_MSEC(COMM_TIMEOUT)) != 0)
+        {
+            LOG_ERR("ERROR: UART TX stalled!\n");
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+int PL455Uart::receive(uint8_t *frame, int size, k_timeout_t timeout)
+{
+    if (k_sem_take(&rxFrames, timeout) != 0)
+    {
+        return -EAGAIN;
+    }
+
+    // frames are self delimiting - the init byte tells us how many data bytes follow
+    ring_buf_get(&rxRing, frame, 1);
+    int length = (frame[0] & 0b01111111) + 4;
+    if (length > size)
+    {
+        LOG_ERR("ERROR: response of %d bytes does not fit %d!\n", length, size);
+        uint8_t dummy[16];
+        int toDrop = length - 1;
+        while (toDrop > 0)
+        {
+            toDrop -= ring_buf_get(&rxRing, dummy, MIN(toDrop, (int)sizeof(dummy)));
+        }
+        return -ENOMEM;
+    }
+    ring_buf_get(&rxRing, frame + 1, length - 1);
+    return length;
+}
+
+void PL455Uart::flush()
+{
+    uint8_t frame[PL455_MAX_FRAME];
+    while (receive(frame, sizeof(frame), K_NO_WAIT) != -EAGAIN)
+    {
+    }
+}
+
+int PL455Uart::sendBreak(uint32_t lowUs)
+{
+    struct uart_config config;
+    int ret = uart_config_get(uartDev, &config);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    // let the frames already queued go out at the normal rate first
+    while (!ring_buf_is_empty(&txRing))
+    {
+        k_sleep(K_USEC(100));
+    }
+    for (int i = 0; (i < 100) && !uart_irq_tx_complete(uartDev); i++)
+    {
+        k_busy_wait(10);
+    }
+
+    // start bit and 8 zero data bits are all low
+    struct uart_config slow = config;
+    slow.baudrate = (9 * 1000000) / lowUs;
+    ret = uart_configure(uartDev, &slow);
+    if (ret == 0)
+    {
+        uart_poll_out(uartDev, 0x00);
+        k_busy_wait(lowUs + (2 * 1000000) / slow.baudrate); // the low time plus the stop bit
+        ret = uart_configure(uartDev, &config);
+    }
+
+    unsigned int key = irq_lock();
+    rxReceived = 0;
+    irq_unlock(key);
+    flush();
+    return ret;
+}
+
+PL455UartStats PL455Uart::getStats()
+{
+    unsigned int key = irq_lock();
+    PL455UartStats copy = stats;
+    irq_unlock(key);
+    return copy;
+}
+
+void PL455Uart::assemble(uint8_t data)
+{
+    uint32_t now = k_cycle_get_32();
+    if (rxReceived != 0 && (now - rxLastByte) > k_us_to_cyc_ceil32(PL455_FRAME_GAP_US))
+    {
+        // a byte got lost somewhere - the rest of this frame is never coming
+        stats.noiseBytes += rxReceived;
+        rxReceived = 0;
+    }
+    rxLastByte = now;
+
+    if (rxReceived == 0)
+    {
+        // first byte of response - bit 7 is 0 for a response frame
+        if ((data >> 7) & 1)
+        {
+            stats.noiseBytes++;
+            return;
+        }
+        rxExpected = (data & 0b01111111) + 4; // init byte, data bytes, two CRC bytes
+        rxCrc = 0;
+    }
+
+    rxFrame[rxReceived++] = data;
+    rxCrc = CRC16Update(rxCrc, data); // the frame is checked the moment its last byte lands
+    if (rxReceived < rxExpected)
+    {
+        return;
+    }
+
+    // received complete frame
+    rxReceived = 0;
+    if (rxCrc != 0)
+    {
+        stats.crcErrors++;
+        return;
+    }
+    if (ring_buf_space_get(&rxRing) < rxExpected)
+    {
+        stats.rxOverflows++;
+        return;
+    }
+    ring_buf_put(&rxRing, rxFrame, rxExpected);
+    stats.framesReceived++;
+    k_sem_give(&rxFrames);
+}
+
+void PL455Uart::isr(const struct device *dev, void *user_data)
+{
+    PL455Uart *self = static_cast<PL455Uart *>(user_data);
+
+    while (uart_irq_update(dev) && uart_irq_is_pending(dev))
+    {
+        if (uart_irq_rx_ready(dev))
+        {
+            uint8_t data[16];
+            int count;
+            while ((count = uart_fifo_read(dev, data, sizeof(data))) > 0)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    self->assemble(data[i]);
+                }
+            }
+        }
+
+        if (uart_irq_tx_ready(dev))
+        {
+            uint8_t *data;
+            uint32_t count = ring_buf_get_claim(&self->txRing, &data, PL455_UART_TX_BUFFER);
+            if (count == 0)
+            {
+                uart_irq_tx_disable(dev);
+            }
+            else
+            {
+                int sent = uart_fifo_fill(dev, data, count);
+                ring_buf_get_finish(&self->txRing, sent);
+                k_sem_give(&self->txSpace);
+            }
+        }
+    }
+}
@@ -1,33 +1,414 @@
 #include "slave.h"
 #include "can.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
 
-Slave::Slave(ModuleData &moduleData, uint8_t id, GPIO &gpio) : mData(moduleData), mId(id), mBalancer(gpio), mGPIO(gpio) {}
+LOG_MODULE_DECLARE(pl455, CONFIG_PL455_LOG_LEVEL);
+
+Slave::Slave(ModuleData &moduleData, uint8_t id, GPIO &gpio, ProtectionHook protectionHook)
+    : mId(id), mData(moduleData), mProtectionHook(protectionHook), mBalancer(gpio, onProtection, this), mGPIO(gpio)
+{
+    k_msgq_init(&captureQueue, (char *)captureQueueBuffer, sizeof(CaptureMessage), ARRAY_SIZE(captureQueueBuffer));
+}
+
+void Slave::onProtection(void *context, uint8_t flags)
+{
+    // straight from the FAULT line, not waiting for the next telemetry round
+    Slave *self = static_cast<Slave *>(context);
+    if (self->mProtectionHook)
+    {
+        self->mProtectionHook(self->mId, flags);
+    }
+    ProtectionState state = {flags};
+    auto base = BaseAddress + (ModuleOffset * self->mId);
+    CAN_SendPriority(base + ProtectionOffset, ((uint8_t *)&state), sizeof(ProtectionState), CAN_PRIO_PROTECTION);
+}
+
+void Slave::onCaptureMessage(uint32_t id, const uint8_t *data, uint8_t dataLen)
+{
+    CaptureMessage message = {};
+    message.channel = id & DataChannelMask;
+    memcpy(message.data, data, MIN(dataLen, sizeof(message.data)));
+    k_msgq_put(&captureQueue, &message, K_NO_WAIT);
+}
 
 bool Slave::worker()
 {
-    mBalancer.runBMS();
+    serviceCapture(BaseAddress + (ModuleOffset * mId));
 
-    if (lastUpdate > 1000)
+    if (publishDue())
     {
         mGPIO.Toggle(GPIO::Name::LED1);
 
         mBalancer.fillModuleData(mData);
 
         auto base = BaseAddress + (ModuleOffset * mId);
-        CAN_Send(base + ModuleStateOffset, ((uint8_t *)&mData.moduleState), sizeof(ModuleState));
-
-        for (int i = 0; i < 32; i++)
+        if (CAN_FD_TELEMETRY && CAN_FdActive())
         {
-            CAN_Send(base + CellStateOffset + i, ((uint8_t *)&mData.cellStates[i]), sizeof(CellState));
+            sendFd(base); // the module state is part of the snapshot
+        }
+        else if (TELEMETRY_PACKED && TELEMETRY_DELTA)
+        {
+            // a frame the TX queue lost leaves the master with an old value it takes as current - send everything again
+            bool keyframe = (sinceKeyframe >= TELEMETRY_KEYFRAME_MS) || telemetryLost();
+            if (keyframe)
+            {
+                sinceKeyframe = 0;
+            }
+            sendPacked(base, keyframe);
+            // ends the round - the master takes whatever didn't come as unchanged
+            CAN_Send(base + ModuleStateOffset + 1, ((uint8_t *)&mData.moduleState), sizeof(ModuleState));
+        }
+        else
+        {
+            CAN_Send(base + ModuleStateOffset, ((uint8_t *)&mData.moduleState), sizeof(ModuleState));
+            if (TELEMETRY_PACKED)
+            {
+                sendPacked(base, true);
+            }
+            else
+            {
+                sendLegacy(base);
+            }
         }
 
-        for (int i = 0; i < 16; i++)
+        if (++publishCount >= LINK_STATS_PUBLISH_CYCLES)
         {
-            CAN_Send(base + AdcVoltageOffset + i, ((uint8_t *)&mData.adcStates[i]), sizeof(uint16_t));
+            sendLinkStats(base);
+            publishCount = 0;
         }
 
         lastUpdate = 0;
         return true;
     }
     return false;
-}
\ No newline at end of file
+}
+void Slave::onCycleMarker(const uint8_t *data, uint8_t dataLen)
+{
+    CycleMarker marker;
+    if (dataLen < sizeof(marker))
+    {
+        return;
+    }
+    memcpy(&marker, data, sizeof(marker));
+    if (marker.cycleMs == 0 || marker.slots == 0)
+    {
+        return;
+    }
+    unsigned int key = irq_lock();
+    markerMs = k_uptime_get_32();
+    cycleMs = marker.cycleMs;
+    cycleSlots = marker.slots;
+    markerSequence = marker.sequence;
+    irq_unlock(key);
+}
+
+bool Slave::publishDue()
+{
+    uint32_t period = mBalancer.getPublishPeriodMs();
+    if (!TELEMETRY_TDMA)
+    {
+        return lastUpdate > period;
+    }
+
+    uint32_t now = k_uptime_get_32();
+    unsigned int key = irq_lock();
+    if (mId == 0 && (now - markerMs >= cycleMs))
+    {
+        // module 0 sits with the master and keeps the time for everyone, on a fixed grid
+        markerMs += ((now - markerMs) / cycleMs) * cycleMs;
+        CycleMarker marker = {cycleMs, cycleSlots, ++markerSequence};
+        irq_unlock(key);
+        CAN_SendPriority(BaseAddress + CycleMarkerOffset, ((uint8_t *)&marker), sizeof(CycleMarker), CAN_PRIO_CONTROL);
+        key = irq_lock();
+    }
+    uint32_t phase = (now - markerMs) % cycleMs;
+    uint32_t slotMs = cycleMs / cycleSlots;
+    uint32_t slotStart = (mId % cycleSlots) * slotMs;
+    uint16_t cycle = cycleMs;
+    irq_unlock(key);
+
+    // only in the first half of our slot, and once per cycle - the rest of the slot lets the burst drain
+    if (phase < slotStart || phase >= slotStart + slotMs / 2 || (lastUpdate + slotMs / 2 < cycle))
+    {
+        return false;
+    }
+    // the last slot before the module's own publish period runs out
+    return lastUpdate + cycle > period;
+}
+
+void Slave::sendCurrent(uint32_t base)
+{
+    if (mData.chargeState.samples != 0)
+    {
+        CAN_Send(base + CurrentOffset + 0, ((uint8_t *)&mData.currentState), sizeof(CurrentState));
+        CAN_Send(base + CurrentOffset + 1, ((uint8_t *)&mData.chargeState), sizeof(ChargeState));
+    }
+}
+
+void Slave::sendLegacy(uint32_t base)
+{
+    // everything optional goes out ahead of the cells and ADCs, so it is part of the set the master completes
+    for (int i = 0; i < ModuleData::auxes; i++)
+    {
+        if (mData.temperatureUpdateFlags.test(i))
+        {
+            CAN_Send(base + TemperatureOffset + i, ((uint8_t *)&mData.temperatures[i]), sizeof(int16_t));
+        }
+    }
+    sendCurrent(base);
+
+    // a lost device's channels don't go out, the master's module timeout takes it from there
+    for (int i = 0; i < ModuleData::cells; i++)
+    {
+        if (mData.cellStatesUpdateFlags.test(i))
+        {
+            CAN_Send(base + CellStateOffset + i, ((uint8_t *)&mData.cellStates[i]), sizeof(CellState));
+        }
+    }
+
+    for (int i = 0; i < ModuleData::auxes; i++)
+    {
+        if (mData.adcUpdateFlags.test(i))
+        {
+            CAN_Send(base + AdcVoltageOffset + i, ((uint8_t *)&mData.adcStates[i]), sizeof(uint16_t));
+        }
+    }
+}
+
+namespace {
+    bool moved(int32_t value, int32_t sent, int32_t deadband)
+    {
+        return abs(value - sent) > deadband;
+    }
+} // anonymous namespace
+
+bool Slave::telemetryLost()
+{
+    // failed and expired aren't kept per priority, a lost frame of any priority counts
+    struct CAN_TxStats stats;
+    CAN_GetTxStats(&stats);
+    uint32_t losses = stats.failed + stats.expired + stats.dropped[CAN_PRIO_TELEMETRY];
+    bool lost = (losses != txLosses);
+    txLosses = losses;
+    return lost;
+}
+
+void Slave::sendPackedTemperatures(uint32_t base, bool keyframe)
+{
+    for (int group = 0; group < ModuleData::auxes / 4; group++)
+    {
+        PackedValues values;
+        bool fitted = false;
+        bool changed = keyframe;
+        for (int i = 0; i < 4; i++)
+        {
+            int aux = group * 4 + i;
+            bool present = mData.temperatureUpdateFlags.test(aux);
+            values.values[i] = present ? mData.temperatures[aux] : TemperatureNotFitted;
+            fitted |= present;
+            changed |= present && moved(mData.temperatures[aux], sent.temperatures[aux], TELEMETRY_TEMPERATURE_DEADBAND);
+        }
+        if (fitted && changed)
+        {
+            if (CAN_Send(base + PackedTemperatureOffset + group, ((uint8_t *)&values), sizeof(PackedValues)) == CAN_SUCCESS)
+            {
+                memcpy(&sent.temperatures[group * 4], values.values, sizeof(values.values));
+            }
+        }
+    }
+}
+
+void Slave::sendPacked(uint32_t base, bool keyframe)
+{
+    // four values per frame instead of one, the balancing flags as a bitmap - same order as the legacy layout.
+    // Outside of a keyframe, only the groups where something moved past its deadband go out.
+    sendPackedTemperatures(base, keyframe);
+    sendCurrent(base);
+
+    for (int group = 0; group < (ModuleData::cells + 31) / 32; group++)
+    {
+        BalanceBitmap bitmap = {0};
+        for (int i = 0; (i < 32) && (group * 32 + i < ModuleData::cells); i++)
+        {
+            bitmap.cells |= uint32_t(mData.cellStates[group * 32 + i].balancing ? 1 : 0) << i;
+        }
+        if (keyframe || (bitmap.cells != sent.balancing[group]))
+        {
+            if (CAN_Send(base + BalanceOffset + group, ((uint8_t *)&bitmap), sizeof(BalanceBitmap)) == CAN_SUCCESS)
+            {
+                sent.balancing[group] = bitmap.cells;
+            }
+        }
+    }
+
+    // a group never spans two devices, so a lost device's groups are left out whole. Forgetting what
+    // was sent for them brings them back on the first round the device answers again.
+    for (int group = 0; group < ModuleData::cells / 4; group++)
+    {
+        if (!mData.cellStatesUpdateFlags.test(group * 4))
+        {
+            memset(&sent.cells[group * 4], 0, sizeof(PackedValues::values));
+            continue;
+        }
+        PackedValues values;
+        bool changed = keyframe;
+        for (int i = 0; i < 4; i++)
+        {
+            int cell = group * 4 + i;
+            values.values[i] = mData.cellStates[cell].voltage;
+            changed |= moved(values.values[i], sent.cells[cell], TELEMETRY_CELL_DEADBAND);
+        }
+        if (changed)
+        {
+            if (CAN_Send(base + PackedCellOffset + group, ((uint8_t *)&values), sizeof(PackedValues)) == CAN_SUCCESS)
+            {
+                memcpy(&sent.cells[group * 4], values.values, sizeof(values.values));
+            }
+        }
+    }
+
+    for (int group = 0; group < ModuleData::auxes / 4; group++)
+    {
+        if (!mData.adcUpdateFlags.test(group * 4))
+        {
+            memset(&sent.adcs[group * 4], 0, sizeof(PackedValues::values));
+            continue;
+        }
+        PackedValues values;
+        bool changed = keyframe;
+        for (int i = 0; i < 4; i++)
+        {
+            int aux = group * 4 + i;
+            values.values[i] = mData.adcStates[aux];
+            changed |= moved(values.values[i], sent.adcs[aux], TELEMETRY_ADC_DEADBAND);
+        }
+        if (changed)
+        {
+            if (CAN_Send(base + PackedAdcOffset + group, ((uint8_t *)&values), sizeof(PackedValues)) == CAN_SUCCESS)
+            {
+                memcpy(&sent.adcs[group * 4], values.values, sizeof(values.values));
+            }
+        }
+    }
+}
+
+void Slave::sendFd(uint32_t base)
+{
+    sendPackedTemperatures(base, true);
+    sendCurrent(base);
+
+    // the snapshot completes the set on the master, so it goes last. It has no room to leave a lost
+    // device out, so there is none until every device answers - the master's module timeout trips.
+    if (!mData.cellStatesUpdateFlags.all())
+    {
+        return;
+    }
+    ModuleData::FdSnapshot snapshot;
+    mData.fillFdSnapshot(snapshot);
+    for (uint8_t segment = 0; segment < ModuleData::fdSegments; segment++)
+    {
+        uint32_t start = segment * FdSegmentBytes;
+        CAN_SendFd(base + FdSnapshotOffset + segment, ((uint8_t *)&snapshot) + start,
+                   MIN(uint32_t(FdSegmentBytes), sizeof(snapshot) - start), CAN_PRIO_TELEMETRY);
+    }
+}
+
+void Slave::sendCaptureStatus(uint32_t base, const PL455CaptureInfo &info)
+{
+    CaptureStatus status = {uint8_t(info.state), info.recordWords, info.records, info.durationUs};
+    CAN_Send(base + CaptureOffset + 2, ((uint8_t *)&status), sizeof(CaptureStatus));
+}
+
+void Slave::serviceCapture(uint32_t base)
+{
+    CaptureMessage message;
+    while (k_msgq_get(&captureQueue, &message, K_NO_WAIT) == 0)
+    {
+        if (message.channel == 0)
+        {
+            CaptureCommand command;
+            memcpy(&command, message.data, sizeof(command));
+            readEnd = readOffset = 0;
+            if (command.trigger == CaptureTriggerCancel)
+            {
+                mBalancer.cancelCapture();
+            }
+            else
+            {
+                PL455CaptureRequest request = {command.device, command.cellMask, command.auxMask, command.durationMs};
+                int ret = mBalancer.startCapture(command.chain, request, command.trigger == CaptureTriggerCurrentStep);
+                if (ret != 0)
+                {
+                    LOG_WRN("Capture rejected: %d\n", ret);
+                }
+            }
+            int chain = mBalancer.getCaptureChain();
+            PL455CaptureInfo info = (chain >= 0) ? mBalancer.getChain(chain).getCaptureInfo() : PL455CaptureInfo{};
+            lastCaptureState = info.state;
+            sendCaptureStatus(base, info);
+        }
+        else if (message.channel == 1)
+        {
+            CaptureRead read;
+            memcpy(&read, message.data, sizeof(read));
+            readOffset = read.offset;
+            readEnd = uint32_t(read.offset) + read.count;
+        }
+    }
+
+    int chain = mBalancer.getCaptureChain();
+    if (chain < 0)
+    {
+        return;
+    }
+    PL455CaptureInfo info = mBalancer.getChain(chain).getCaptureInfo();
+    if (info.state != lastCaptureState)
+    {
+        // tells the host when an armed capture fired and when the data is ready
+        lastCaptureState = info.state;
+        sendCaptureStatus(base, info);
+    }
+
+    // a few frames per pass, so a long read doesn't hold up the telemetry
+    for (int frame = 0; (frame < CAPTURE_FRAMES_PER_PASS) && (readOffset < readEnd); frame++)
+    {
+        uint16_t words[ARRAY_SIZE(CaptureData::words)];
+        int count = mBalancer.readCapture(readOffset, words, MIN(readEnd - readOffset, ARRAY_SIZE(words)));
+        if (count <= 0)
+        {
+            readEnd = readOffset = 0;
+            break;
+        }
+        CaptureData data = {uint16_t(readOffset), {}};
+        memcpy(data.words, words, count * sizeof(uint16_t));
+        CAN_Send(base + CaptureOffset + 3, ((uint8_t *)&data), sizeof(uint16_t) * (1 + count));
+        readOffset += count;
+    }
+}
+
+void Slave::sendLinkStats(uint32_t base)
+{
+    for (int chain = 0; chain < mBalancer.getNumChains(); chain++)
+    {
+        PL455 &pl455 = mBalancer.getChain(chain);
+        PL455Health health = pl455.getHealth();
+        uint8_t slot = mBalancer.getFirstSlot(chain);
+        for (int device = 0; device < pl455.getNumModules(); device++, slot++)
+        {
+            LinkDeviceStats deviceStats = {uint16_t(MIN(health.link.timeouts[device], UINT16_MAX)),
+                                           uint16_t(MIN(health.link.crcErrors[device], UINT16_MAX))};
+            CAN_Send(base + LinkStatsOffset + slot, ((uint8_t *)&deviceStats), sizeof(LinkDeviceStats));
+        }
+        LinkChainStats chainStats = {uint16_t(MIN(health.uart.noiseBytes, UINT16_MAX)),
+                                     uint16_t(MIN(health.link.retries, UINT16_MAX)),
+                                     uint8_t(MIN(health.link.breaks, UINT8_MAX)),
+                                     uint8_t(MIN(health.link.resets, UINT8_MAX)),
+                                     uint8_t(MIN(health.reinits, UINT8_MAX)),
+                                     uint8_t(MIN(health.uart.rxOverflows, UINT8_MAX))};
+        CAN_Send(base + LinkStatsOffset + LinkChainChannel + chain, ((uint8_t *)&chainStats), sizeof(LinkChainStats));
+    }
+    AcquisitionRate rate = {mBalancer.getCyclePeriodUs(), uint16_t(MIN(mBalancer.getPublishPeriodMs(), UINT16_MAX))};
+    CAN_Send(base + LinkStatsOffset + LinkRateChannel, ((uint8_t *)&rate), sizeof(AcquisitionRate));
+}